@@ -28,43 +28,219 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 
 #include <string>
+#include <vector>
 #include <new>
+#include <system_error>
+#include <thread>
 using std::nothrow;
 
 #include <re2/re2.h>
 #include <re2/set.h>
+#include <re2/filtered_re2.h>
 using re2::RE2;
 using re2::StringPiece;
+using re2::FilteredRE2;
 
 #include <structmember.h>
 
+// METH_FASTCALL (with keyword support) is only usable from 3.7 on.  Methods
+// that take the search arguments are declared through these macros so that
+// older interpreters keep the METH_VARARGS signatures.
+#if PY_VERSION_HEX >= 0x03070000
+#define HAVE_FASTCALL
+#define SEARCH_PARAMS PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames
+#define SEARCH_ARGS args, nargs, kwnames
+#define SEARCH_FLAGS (METH_FASTCALL | METH_KEYWORDS)
+#define ACCESSOR_PARAMS PyObject* const* args, Py_ssize_t nargs
+#define ACCESSOR_ARGS args, nargs
+#define ACCESSOR_FLAGS METH_FASTCALL
+#else
+#define SEARCH_PARAMS PyObject* args, PyObject* kwds
+#define SEARCH_ARGS args, kwds
+#define SEARCH_FLAGS (METH_VARARGS | METH_KEYWORDS)
+#define ACCESSOR_PARAMS PyObject* args
+#define ACCESSOR_ARGS &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args)
+#define ACCESSOR_FLAGS METH_VARARGS
+#endif
+
+// Matches over fewer bytes than this keep the GIL: releasing and
+// reacquiring it costs more than scanning a short subject.
+static const Py_ssize_t GIL_RELEASE_THRESHOLD = 8192;
+
+// re flags accepted by compile and Set, with the same values as in re.
+#define FLAG_IGNORECASE 2
+#define FLAG_MULTILINE 8
+#define FLAG_DOTALL 16
+#define FLAG_ASCII 256
+#define SUPPORTED_FLAGS (FLAG_IGNORECASE | FLAG_MULTILINE | FLAG_DOTALL | FLAG_ASCII)
+
+// In Perl syntax RE2 has no multi-line option (one_line is only consulted
+// for POSIX syntax), so MULTILINE patterns in that syntax are compiled with
+// this flag group in front.  See _multiline_prefix.
+#define MULTILINE_PREFIX "(?m)"
 
 typedef struct _RegexpObject2 {
   PyObject_HEAD
   RE2* re2_obj;
+  // The same pattern compiled for Latin-1 text, used to match str subjects
+  // of the 1-byte PEP 393 kind in place.  Compiled on first use; NULL if
+  // that hasn't happened yet or the pattern can't be expressed in Latin-1.
+  RE2* re2_latin1;
+  bool latin1_tried;
+  // Leftmost-longest versions of the two programs, used to look for a
+  // non-empty match where an empty one just ended.  Compiled on first use,
+  // and only for patterns that can match empty at all.
+  RE2* re2_longest;
+  RE2* re2_latin1_longest;
+  bool longest_tried;
+  bool latin1_longest_tried;
   Py_ssize_t groups;
+  // Maps each group name, interned, to its number, in order of number.
+  // Built at compile time; group('name') and groupdict() look names up in
+  // it and reuse its keys.
   PyObject* groupindex;
   PyObject* pattern;
+  // The re flags the pattern was compiled with.  Options set by them or by
+  // keyword are in re2_obj->options().
+  int flags;
+  // The exception class passed to _compile, raised for bad templates.
+  PyObject* error_class;
+  // Parsed sub() templates (as capsules), keyed by template object.
+  PyObject* templates;
+  // While the regexp is in the compile cache: its key there, and its
+  // neighbours in the cache's recency list.  cache_key is NULL otherwise.
+  PyObject* cache_key;
+  struct _RegexpObject2* cache_newer;
+  struct _RegexpObject2* cache_older;
 } RegexpObject2;
 
+// Translates between byte offsets into the UTF-8 form of a str and code
+// point offsets into the str itself.  checkpoints[i] is the byte offset of
+// code point i * UTF8_INDEX_STRIDE; they are filled in lazily, only as far
+// into the subject as lookups have needed so far.  Each SearchState makes
+// its own index, shared by reference count with the matches it creates, so
+// only matches from the same search or scan share one.
+#define UTF8_INDEX_STRIDE 64
+
+typedef struct _Utf8Index {
+  Py_ssize_t refcnt;
+  const char* data;
+  Py_ssize_t size;
+  std::vector<Py_ssize_t> checkpoints;
+} Utf8Index;
+
 typedef struct _MatchObject2 {
-  PyObject_HEAD
+  PyObject_VAR_HEAD
+  // While the object sits on the freelist, re links to the next free match.
   PyObject* re;
   PyObject* string;
   Py_ssize_t pos; /* beginning of target slice */
   Py_ssize_t endpos; /* end of target slice */
+  // For subjects other than str and bytes, the buffer we matched against.
+  // Holding it keeps the exporter (e.g. a bytearray) from resizing or
+  // freeing the memory while the match is alive.  view.obj is NULL when
+  // there is no buffer.
+  Py_buffer view;
+  // Set iff the subject is a non-ASCII str, whose group offsets are stored
+  // as UTF-8 byte offsets and translated to code points on access.
+  Utf8Index* index;
+  // Searches only ask RE2 for the overall match, which it can find with
+  // the DFA alone.  Until a group is needed (see _match_resolve), lazy_re
+  // is the program that matched and lazy_data/lazy_size the subject bytes
+  // it matched, and only group 0's offsets are valid.  NULL once every
+  // group has been extracted.
+  const RE2* lazy_re;
+  const char* lazy_data;
+  Py_ssize_t lazy_size;
   // There are several possible approaches to storing the matched groups:
   // 1. Fully materialize the groups tuple at match time.
   // 2. Cache allocated PyBytes objects when groups are requested.
   // 3. Always allocate new PyBytess on demand.
   // I've chosen to go with #3.  It's the simplest, and I'm pretty sure it's
   // optimal in all cases where no group is fetched more than once.
-  StringPiece* groups;
+  //
+  // The groups are stored inline as (start, end) offsets into the subject,
+  // so ob_size is twice the number of groups including group 0.  Groups that
+  // did not participate in the match have both offsets set to -1.
+  Py_ssize_t spans[1];
 } MatchObject2;
 
+#define MATCH_NGROUPS(m) (Py_SIZE(m) / 2)
+
+// The bytes a regexp or set is matched against.  For str this is the UTF-8
+// representation, for bytes the object's own storage, and for anything else
+// the C-contiguous buffer it exports.
+typedef struct _Subject {
+  const char* data;
+  Py_ssize_t size;
+  // Filled in (view.obj != NULL) only when the buffer protocol was used.
+  Py_buffer view;
+  // True for non-ASCII str, where byte offsets into data are not code point
+  // offsets into the str.
+  bool utf8_str;
+  // A temporary UTF-8 encoding of a str that we chose not to cache on the
+  // str itself, or NULL.
+  PyObject* encoded;
+} Subject;
+
+// A subject prepared for matching against one regexp: the program chosen
+// for it (UTF-8 or Latin-1), its bytes, and the clamped search range.
+typedef struct _SearchState {
+  RE2* re;
+  Subject subject;
+  // For non-ASCII str subjects; NULL until some offset needs translating.
+  Utf8Index* index;
+  // pos and endpos count code points for str subjects, bytes otherwise.
+  Py_ssize_t pos;
+  Py_ssize_t endpos;
+  Py_ssize_t byte_pos;
+  Py_ssize_t byte_endpos;
+  // For scans (see _search_state_prepare_scan): the longest-match version
+  // of re, or NULL, and whether the last match found was empty.
+  const RE2* longest;
+  bool after_empty;
+} SearchState;
+
+typedef struct _IteratorObject2 {
+  PyObject_HEAD
+  PyObject* re;
+  PyObject* string;
+  SearchState state;
+  // Byte offset to resume scanning from; past byte_endpos when exhausted.
+  Py_ssize_t next;
+  StringPiece* groups;
+} IteratorObject2;
+
+// A read-only, one-dimensional array of integers exposed through the buffer
+// protocol, for batch results that shouldn't need an object per element.
+typedef struct _ArrayObject2 {
+  PyObject_HEAD
+  // The item format, as in the struct module.
+  char format[2];
+  Py_ssize_t itemsize;
+  Py_ssize_t length;
+  // length * itemsize: the shape of views that don't ask for the format,
+  // which see the items as unsigned bytes.
+  Py_ssize_t nbytes;
+  void* data;
+} ArrayObject2;
+
+// Recently freed match objects are kept on per-size freelists so that a
+// tight search() loop doesn't hit the allocator.  Only patterns with up to
+// MATCH_FREELIST_MAXGROUPS groups (including group 0) are recycled.
+#define MATCH_FREELIST_MAXGROUPS 16
+#define MATCH_FREELIST_MAXLEN 32
+static MatchObject2* match_freelist[MATCH_FREELIST_MAXGROUPS];
+static int match_freelist_len[MATCH_FREELIST_MAXGROUPS];
+
+// Submatch vectors up to this length live on the stack in _do_search.
+#define SEARCH_STACK_GROUPS 16
+
 
 // Forward declaration of getter functions
 static PyObject* match_pos_get(MatchObject2* self);
@@ -74,10 +250,14 @@ static PyObject* match_string_get(MatchObject2* self);
 static PyObject* regexp_groups_get(RegexpObject2* self);
 static PyObject* regexp_groupindex_get(RegexpObject2* self);
 static PyObject* regexp_pattern_get(RegexpObject2* self);
+static PyObject* regexp_flags_get(RegexpObject2* self);
+static PyObject* regexp_options_get(RegexpObject2* self);
 
 static PyGetSetDef regexp_getset[] = {
+  {(char *)"flags",         (getter)regexp_flags_get,       (setter)NULL},
   {(char *)"groupindex",    (getter)regexp_groupindex_get,  (setter)NULL},
   {(char *)"groups",        (getter)regexp_groups_get,      (setter)NULL},
+  {(char *)"options",       (getter)regexp_options_get,     (setter)NULL},
   {(char *)"pattern",       (getter)regexp_pattern_get,     (setter)NULL},
   {NULL}
 };
@@ -94,65 +274,247 @@ typedef struct _RegexpSetObject2 {
   PyObject_HEAD
   // True iff re2_set_obj has been compiled.
   bool compiled;
+  // The re flags patterns are added with.
+  int flags;
+  RE2::Options* options;
+  // The number of patterns added.
+  int size;
+  // True while the GIL is released around adding to or compiling
+  // re2_set_obj, which mustn't be touched from other threads meanwhile.
+  bool busy;
   RE2::Set* re2_set_obj;
 } RegexpSetObject2;
 
+// Reads a stream of bytes, from an object with readinto() or an iterable
+// of bytes-like chunks, into a window that slides along the stream.
+typedef struct _StreamReader {
+  // source.readinto, or NULL if reading from iter.
+  PyObject* readinto;
+  PyObject* iter;
+  std::vector<char>* buf;
+  // The number of bytes of buf in use.
+  Py_ssize_t len;
+  // The stream offset of buf[0].
+  PY_LONG_LONG base;
+  Py_ssize_t chunk_size;
+  bool eof;
+} StreamReader;
+
+typedef struct _StreamIteratorObject2 {
+  PyObject_HEAD
+  PyObject* re;
+  StreamReader reader;
+  // Offset in the window to resume searching from.
+  Py_ssize_t next;
+  Py_ssize_t max_match_len;
+  // As in SearchState: the longest-match program, or NULL, and whether
+  // the last match was empty.
+  const RE2* longest;
+  bool after_empty;
+  // True while the GIL is released around a search of the window.
+  bool busy;
+} StreamIteratorObject2;
+
+// The default memory budget of a FilteredSet's atom matcher per byte of
+// atoms.  Case-insensitive literals take about 50 bytes per byte to
+// compile; the rest is left for the DFA.
+#define ATOM_MEM_PER_BYTE 128
+
+typedef struct _FilteredSetObject2 {
+  PyObject_HEAD
+  // True iff filtered has been compiled.
+  bool compiled;
+  // True while the GIL is released around compiling.
+  bool busy;
+  // The re flags patterns are added with.
+  int flags;
+  RE2::Options* options;
+  FilteredRE2* filtered;
+  // Matches the atoms filtered requires, as case-insensitive literals.
+  // NULL if no pattern had any atoms.
+  RE2::Set* atoms;
+  // The memory budget for atoms, or 0 to size it from the atoms.
+  PY_LONG_LONG atom_max_mem;
+  // Compile-time statistics.
+  Py_ssize_t n_atoms;
+  Py_ssize_t atom_bytes;
+  Py_ssize_t n_unfiltered;
+  Py_ssize_t program_size;
+  // Match-time statistics: texts matched, those the atom matcher failed
+  // on (so every pattern was tried), patterns verified against them, and
+  // patterns that matched.
+  Py_ssize_t n_texts;
+  Py_ssize_t n_unfiltered_texts;
+  Py_ssize_t n_candidates;
+  Py_ssize_t n_matches;
+} FilteredSetObject2;
+
 
 // Forward declarations of methods, creators, and destructors.
 static void regexp_dealloc(RegexpObject2* self);
-static PyObject* create_regexp(PyObject* self, PyObject* pattern, PyObject* error_class);
-static PyObject* regexp_search(RegexpObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* regexp_match(RegexpObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* regexp_fullmatch(RegexpObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* regexp_test_search(RegexpObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* regexp_test_match(RegexpObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* regexp_test_fullmatch(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* create_regexp(PyObject* self, PyObject* pattern, PyObject* error_class, int flags, const RE2::Options& options);
+static bool _subject_get(PyObject* string, Subject* subject, const char* type_error, bool cache_utf8);
+static void _subject_release(Subject* subject);
+static PyObject* regexp_search(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_match(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_fullmatch(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_test_search(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_test_match(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_test_fullmatch(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_finditer(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_findall(RegexpObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_test_many(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_extract_many(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_grep_lines(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_test_arrow(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_split(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_sub(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_subn(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static void iterator_dealloc(IteratorObject2* self);
+static PyObject* iterator_next(IteratorObject2* self);
 static void match_dealloc(MatchObject2* self);
-static PyObject* create_match(PyObject* re, PyObject* string, long pos, long endpos, StringPiece* groups);
-static PyObject* match_group(MatchObject2* self, PyObject* args);
+static PyObject* create_match(PyObject* re, PyObject* string, SearchState* state, const StringPiece* groups, int n_found);
+static void _match_set_spans(MatchObject2* match, const char* subject, const StringPiece* groups, int n_groups);
+static PyObject* match_group(MatchObject2* self, ACCESSOR_PARAMS);
 static PyObject* match_groups(MatchObject2* self, PyObject* args, PyObject* kwds);
 static PyObject* match_groupdict(MatchObject2* self, PyObject* args, PyObject* kwds);
-static PyObject* match_start(MatchObject2* self, PyObject* args);
-static PyObject* match_end(MatchObject2* self, PyObject* args);
-static PyObject* match_span(MatchObject2* self, PyObject* args);
+static PyObject* match_start(MatchObject2* self, ACCESSOR_PARAMS);
+static PyObject* match_end(MatchObject2* self, ACCESSOR_PARAMS);
+static PyObject* match_span(MatchObject2* self, ACCESSOR_PARAMS);
+static PyObject* match_spans(MatchObject2* self);
+static PyObject* match_group_view(MatchObject2* self, ACCESSOR_PARAMS);
+template <typename T> static PyObject* create_array(const std::vector<T>& values, char format);
 static void regexp_set_dealloc(RegexpSetObject2* self);
 static PyObject* regexp_set_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
 static PyObject* regexp_set_add(RegexpSetObject2* self, PyObject* pattern);
+static PyObject* regexp_set_add_many(RegexpSetObject2* self, PyObject* patterns);
 static PyObject* regexp_set_compile(RegexpSetObject2* self);
-static PyObject* regexp_set_match(RegexpSetObject2* self, PyObject* text);
+static PyObject* regexp_set_match(RegexpSetObject2* self, SEARCH_PARAMS);
+static PyObject* regexp_set_test(RegexpSetObject2* self, PyObject* text);
+static PyObject* regexp_set_match_stream(RegexpSetObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_scan_stream(RegexpObject2* self, PyObject* args, PyObject* kwds);
+static void stream_iterator_dealloc(StreamIteratorObject2* self);
+static PyObject* stream_iterator_next(StreamIteratorObject2* self);
+static void filtered_set_dealloc(FilteredSetObject2* self);
+static PyObject* filtered_set_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
+static PyObject* filtered_set_add(FilteredSetObject2* self, PyObject* pattern);
+static PyObject* filtered_set_compile(FilteredSetObject2* self);
+static PyObject* filtered_set_match(FilteredSetObject2* self, PyObject* text);
+static PyObject* filtered_set_test(FilteredSetObject2* self, PyObject* text);
+static PyObject* filtered_set_stats(FilteredSetObject2* self);
+static PyObject* regexp_set_match_many(RegexpSetObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_set_grep_lines(RegexpSetObject2* self, PyObject* args, PyObject* kwds);
+static PyObject* regexp_set_test_arrow(RegexpSetObject2* self, PyObject* args, PyObject* kwds);
+static void array_dealloc(ArrayObject2* self);
+static Py_ssize_t array_length(ArrayObject2* self);
+static PyObject* array_item(ArrayObject2* self, Py_ssize_t i);
+static int array_getbuffer(ArrayObject2* self, Py_buffer* view, int flags);
 
 
 static PyMethodDef regexp_methods[] = {
-  {"search", (PyCFunction)regexp_search, METH_VARARGS | METH_KEYWORDS,
+  {"search", (PyCFunction)(void(*)(void))regexp_search, SEARCH_FLAGS,
     "search(string[, pos[, endpos]]) --> match object or None.\n"
     "    Scan through string looking for a match, and return a corresponding\n"
     "    MatchObject instance. Return None if no position in the string matches."
   },
-  {"match", (PyCFunction)regexp_match, METH_VARARGS | METH_KEYWORDS,
+  {"match", (PyCFunction)(void(*)(void))regexp_match, SEARCH_FLAGS,
     "match(string[, pos[, endpos]]) --> match object or None.\n"
     "    Matches zero or more characters at the beginning of the string"
   },
-  {"fullmatch", (PyCFunction)regexp_fullmatch, METH_VARARGS | METH_KEYWORDS,
+  {"fullmatch", (PyCFunction)(void(*)(void))regexp_fullmatch, SEARCH_FLAGS,
     "fullmatch(string[, pos[, endpos]]) --> match object or None.\n"
     "    Matches the entire string"
   },
-  {"test_search", (PyCFunction)regexp_test_search, METH_VARARGS | METH_KEYWORDS,
+  {"test_search", (PyCFunction)(void(*)(void))regexp_test_search, SEARCH_FLAGS,
     "test_search(string[, pos[, endpos]]) --> bool.\n"
     "    Like 'search', but only returns whether a match was found."
   },
-  {"test_match", (PyCFunction)regexp_test_match, METH_VARARGS | METH_KEYWORDS,
+  {"test_match", (PyCFunction)(void(*)(void))regexp_test_match, SEARCH_FLAGS,
     "test_match(string[, pos[, endpos]]) --> match object or None.\n"
     "    Like 'match', but only returns whether a match was found."
   },
-  {"test_fullmatch", (PyCFunction)regexp_test_fullmatch, METH_VARARGS | METH_KEYWORDS,
+  {"test_fullmatch", (PyCFunction)(void(*)(void))regexp_test_fullmatch, SEARCH_FLAGS,
     "test_fullmatch(string[, pos[, endpos]]) --> match object or None.\n"
     "    Like 'fullmatch', but only returns whether a match was found."
   },
+  {"finditer", (PyCFunction)(void(*)(void))regexp_finditer, SEARCH_FLAGS,
+    "finditer(string[, pos[, endpos]]) --> iterator.\n"
+    "    Return an iterator over all non-overlapping matches for the pattern\n"
+    "    in string.  For each match, the iterator returns a match object.\n"
+    "    A non-empty match right after an empty one is the longest there,\n"
+    "    which differs from re for lazy quantifiers (see README)."
+  },
+  {"findall", (PyCFunction)(void(*)(void))regexp_findall, SEARCH_FLAGS,
+    "findall(string[, pos[, endpos]]) --> list.\n"
+    "    Return a list of all non-overlapping matches of pattern in string.\n"
+    "    A non-empty match right after an empty one is the longest there,\n"
+    "    which differs from re for lazy quantifiers (see README)."
+  },
+  {"extract_many", (PyCFunction)regexp_extract_many, METH_VARARGS | METH_KEYWORDS,
+    "extract_many(texts[, spans=False, num_threads=1]) --> dict\n"
+    "    Search each of a sequence of texts, returning the capturing groups\n"
+    "    as columns: a dict from each group's name, or number if it has none,\n"
+    "    to a list of the group's value in each text (str for str texts,\n"
+    "    bytes otherwise), or None where the search failed or the group\n"
+    "    didn't participate.  With spans, each\n"
+    "    column is instead a pair of integer arrays (starts, ends), with -1\n"
+    "    for missing values.  num_threads is as for test_many."
+  },
+  {"grep_lines", (PyCFunction)regexp_grep_lines, METH_VARARGS | METH_KEYWORDS,
+    "grep_lines(buffer[, spans=False, num_threads=1]) --> lines\n"
+    "    Search each line of a bytes-like buffer, returning an integer array of\n"
+    "    the (0-based) numbers of the lines that match.  Lines are split on\n"
+    "    \\n, which is not part of the line.  With spans, return\n"
+    "    (lines, starts, ends), where starts and ends are the lines' byte\n"
+    "    offsets.  num_threads is as for test_many."
+  },
+  {"test_arrow", (PyCFunction)regexp_test_arrow, METH_VARARGS | METH_KEYWORDS,
+    "test_arrow(offsets, data[, length, validity, offset=0, large=False,\n"
+    "           as_bitmap=False, num_threads=1]) --> array of bool or bytes\n"
+    "    Like test_many for the strings of an Arrow-style string column, given\n"
+    "    as buffers: element i is data[offsets[offset + i]:offsets[offset + i + 1]].\n"
+    "    offsets holds 32-bit integers, or 64-bit ones if its item size is 8\n"
+    "    or, for untyped buffers, if large is true.  length defaults to the\n"
+    "    rest of offsets.  Elements whose bit offset + i is clear in the\n"
+    "    validity bitmap are null and test false.  With as_bitmap, return the\n"
+    "    result as a bit-packed bytes object (bit i % 8 of byte i // 8)."
+  },
+  {"test_many", (PyCFunction)regexp_test_many, METH_VARARGS | METH_KEYWORDS,
+    "test_many(texts[, num_threads=1]) --> array of bool\n"
+    "    Like test_search for each of a sequence of texts, returning a\n"
+    "    boolean array supporting the buffer protocol.  num_threads > 1\n"
+    "    spreads the texts over that many native threads; 0 uses one per CPU."
+  },
+  {"scan_stream", (PyCFunction)regexp_scan_stream, METH_VARARGS | METH_KEYWORDS,
+    "scan_stream(source[, max_match_len=65536, chunk_size=65536]) --> iterator\n"
+    "    Search a stream of bytes for non-overlapping matches, yielding\n"
+    "    (start, end, matched bytes) with offsets from the start of the stream.\n"
+    "    source is an object with readinto(), such as a file or socket, or an\n"
+    "    iterable of bytes-like chunks.  Matches may span chunks; matches longer\n"
+    "    than max_match_len bytes may be missed or cut short, and memory use\n"
+    "    is bounded by max_match_len plus chunk_size.  Empty matches are\n"
+    "    handled as by finditer, which can differ from re (see README)."
+  },
+  {"split", (PyCFunction)regexp_split, METH_VARARGS | METH_KEYWORDS,
+    "split(string[, maxsplit=0]) --> list.\n"
+    "    Split string by the occurrences of pattern.  Empty matches are\n"
+    "    found as by finditer, which can differ from re (see README)."
+  },
+  {"sub", (PyCFunction)regexp_sub, METH_VARARGS | METH_KEYWORDS,
+    "sub(repl, string[, count=0]) --> newstring.\n"
+    "    Return the string obtained by replacing the leftmost non-overlapping\n"
+    "    occurrences of pattern in string by the replacement repl.  Empty\n"
+    "    matches are found as by finditer, which can differ from re (see README)."
+  },
+  {"subn", (PyCFunction)regexp_subn, METH_VARARGS | METH_KEYWORDS,
+    "subn(repl, string[, count=0]) --> (newstring, number of subs)\n"
+    "    Like 'sub', but also returns the number of substitutions made."
+  },
   {NULL}  /* Sentinel */
 };
 
 static PyMethodDef match_methods[] = {
-  {"group", (PyCFunction)match_group, METH_VARARGS,
+  {"group", (PyCFunction)(void(*)(void))match_group, ACCESSOR_FLAGS,
     NULL
   },
   {"groups", (PyCFunction)match_groups, METH_VARARGS | METH_KEYWORDS,
@@ -161,15 +523,27 @@ static PyMethodDef match_methods[] = {
   {"groupdict", (PyCFunction)match_groupdict, METH_VARARGS | METH_KEYWORDS,
     NULL
   },
-  {"start", (PyCFunction)match_start, METH_VARARGS,
+  {"start", (PyCFunction)(void(*)(void))match_start, ACCESSOR_FLAGS,
     NULL
   },
-  {"end", (PyCFunction)match_end, METH_VARARGS,
+  {"end", (PyCFunction)(void(*)(void))match_end, ACCESSOR_FLAGS,
     NULL
   },
-  {"span", (PyCFunction)match_span, METH_VARARGS,
+  {"span", (PyCFunction)(void(*)(void))match_span, ACCESSOR_FLAGS,
     NULL
   },
+  {"spans", (PyCFunction)match_spans, METH_NOARGS,
+    "spans() --> array\n"
+    "    Return the (start, end) offsets of every group, group 0 included,\n"
+    "    as a flat integer array: group i spans [2 * i] to [2 * i + 1], both\n"
+    "    -1 if the group didn't participate."
+  },
+  {"group_view", (PyCFunction)(void(*)(void))match_group_view, ACCESSOR_FLAGS,
+    "group_view([group]) --> memoryview or None\n"
+    "    Return a memoryview of the bytes a group matched within the subject,\n"
+    "    without copying them, or None if the group didn't participate.  The\n"
+    "    subject must be bytes-like; a view of a mutable one is writable."
+  },
   {NULL}  /* Sentinel */
 };
 
@@ -178,13 +552,78 @@ static PyMethodDef regexp_set_methods[] = {
     "add(pattern) --> index or raises an exception.\n"
     "    Add a pattern to the set, raising if the pattern doesn't parse."
   },
+  {"add_many", (PyCFunction)regexp_set_add_many, METH_O,
+    "add_many(patterns) --> list\n"
+    "    Add each of a sequence of patterns to the set.  Each item of the result\n"
+    "    is the pattern's index, or a ValueError if it doesn't parse."
+  },
   {"compile", (PyCFunction)regexp_set_compile, METH_NOARGS,
     "compile() --> None or raises an exception.\n"
     "    Compile the set to prepare it for matching."
   },
-  {"match", (PyCFunction)regexp_set_match, METH_O,
+  {"match", (PyCFunction)(void(*)(void))regexp_set_match, SEARCH_FLAGS,
+    "match(text[, as_bitmap=False]) --> list or bytes\n"
+    "    Match text against the set, returning the indexes of the added patterns.\n"
+    "    With as_bitmap, return a bytes object with bit i % 8 of byte i // 8 set\n"
+    "    if pattern i matched instead."
+  },
+  {"match_stream", (PyCFunction)regexp_set_match_stream, METH_VARARGS | METH_KEYWORDS,
+    "match_stream(source[, max_match_len=65536, chunk_size=65536]) --> list\n"
+    "    Match a stream of bytes against the set, returning the sorted indexes\n"
+    "    of the patterns that matched anywhere in it.  source is as for\n"
+    "    Regexp.scan_stream.  The stream is matched in overlapping windows,\n"
+    "    so ^, $ and \\b may also match at window edges."
+  },
+  {"test", (PyCFunction)regexp_set_test, METH_O,
+    "test(text) --> bool\n"
+    "    Return whether any pattern in the set matches text, stopping at the\n"
+    "    first match."
+  },
+  {"grep_lines", (PyCFunction)regexp_set_grep_lines, METH_VARARGS | METH_KEYWORDS,
+    "grep_lines(buffer[, spans=False, num_threads=1]) --> (lines, offsets, indexes)\n"
+    "    Match each line of a bytes-like buffer against the set, as for\n"
+    "    Regexp.grep_lines.  The indexes of the patterns matching line\n"
+    "    lines[i] are indexes[offsets[i]:offsets[i + 1]].  With spans, return\n"
+    "    (lines, starts, ends, offsets, indexes)."
+  },
+  {"test_arrow", (PyCFunction)regexp_set_test_arrow, METH_VARARGS | METH_KEYWORDS,
+    "test_arrow(offsets, data[, length, validity, offset=0, large=False,\n"
+    "           as_bitmap=False, num_threads=1]) --> array of bool or bytes\n"
+    "    Test whether any pattern matches each string of an Arrow-style\n"
+    "    string column; arguments are as for Regexp.test_arrow."
+  },
+  {"match_many", (PyCFunction)regexp_set_match_many, METH_VARARGS | METH_KEYWORDS,
+    "match_many(texts[, num_threads=1]) --> (offsets, indexes)\n"
+    "    Match each of a sequence of texts against the set.  The indexes of the\n"
+    "    patterns matching texts[i] are indexes[offsets[i]:offsets[i + 1]].\n"
+    "    Both results are integer arrays supporting the buffer protocol.\n"
+    "    num_threads > 1 spreads the texts over that many native threads;\n"
+    "    0 uses one per CPU."
+  },
+  {NULL}  /* Sentinel */
+};
+
+static PyMethodDef filtered_set_methods[] = {
+  {"add", (PyCFunction)filtered_set_add, METH_O,
+    "add(pattern) --> index or raises an exception.\n"
+    "    Add a pattern to the set, raising if the pattern doesn't parse."
+  },
+  {"compile", (PyCFunction)filtered_set_compile, METH_NOARGS,
+    "compile() --> None or raises an exception.\n"
+    "    Extract the patterns' literal atoms and prepare the set for matching."
+  },
+  {"match", (PyCFunction)filtered_set_match, METH_O,
     "match(text) --> list\n"
-    "    Match text against the set, returning the indexes of the added patterns."
+    "    Match text against the set, returning the sorted indexes of the added\n"
+    "    patterns.  Only patterns whose atoms occur in text are tried."
+  },
+  {"test", (PyCFunction)filtered_set_test, METH_O,
+    "test(text) --> bool\n"
+    "    Return whether any pattern in the set matches text."
+  },
+  {"stats", (PyCFunction)filtered_set_stats, METH_NOARGS,
+    "stats() --> dict\n"
+    "    Return the set's size, atom, and candidate statistics."
   },
   {NULL}  /* Sentinel */
 };
@@ -257,8 +696,8 @@ static PyTypeObject Match_Type2 = {
   0,                           /*ob_size*/
 #endif
   "_re2.RE2_Match",            /*tp_name*/
-  sizeof(MatchObject2),        /*tp_basicsize*/
-  0,                           /*tp_itemsize*/
+  offsetof(MatchObject2, spans), /*tp_basicsize*/
+  sizeof(Py_ssize_t),          /*tp_itemsize*/
   (destructor)match_dealloc,   /*tp_dealloc*/
   0,                           /*tp_print*/
   0,                           /*tp_getattr*/
@@ -339,6 +778,182 @@ static PyTypeObject RegexpSet_Type2 = {
   regexp_set_new,                  /*tp_new*/
 };
 
+static PyTypeObject FilteredSet_Type2 = {
+  PyObject_HEAD_INIT(NULL)
+#if PY_MAJOR_VERSION < 3
+  0,                               /*ob_size*/
+#endif
+  "_re2.RE2_FilteredSet",          /*tp_name*/
+  sizeof(FilteredSetObject2),      /*tp_basicsize*/
+  0,                               /*tp_itemsize*/
+  (destructor)filtered_set_dealloc, /*tp_dealloc*/
+  0,                               /*tp_print*/
+  0,                               /*tp_getattr*/
+  0,                               /*tp_setattr*/
+  0,                               /*tp_compare*/
+  0,                               /*tp_repr*/
+  0,                               /*tp_as_number*/
+  0,                               /*tp_as_sequence*/
+  0,                               /*tp_as_mapping*/
+  0,                               /*tp_hash*/
+  0,                               /*tp_call*/
+  0,                               /*tp_str*/
+  0,                               /*tp_getattro*/
+  _no_setattr,                     /*tp_setattro*/
+  0,                               /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,              /*tp_flags*/
+  "FilteredSet(min_atom_len=0, flags=0, atom_max_mem=None, **options)\n"
+  "    RE2 prefiltered regexp set objects.  options apply to each pattern.\n"
+  "    The atoms are found with a DFA whose memory grows with their total\n"
+  "    size: by default up to 128 bytes per byte of atoms (about 90 MB for\n"
+  "    100,000 short words), or atom_max_mem bytes if given.  compile()\n"
+  "    raises MemoryError if that is too little; texts the DFA runs out of\n"
+  "    memory on are matched against every pattern.", /*tp_doc*/
+  0,                               /*tp_traverse*/
+  0,                               /*tp_clear*/
+  0,                               /*tp_richcompare*/
+  0,                               /*tp_weaklistoffset*/
+  0,                               /*tp_iter*/
+  0,                               /*tp_iternext*/
+  filtered_set_methods,            /*tp_methods*/
+  0,                               /*tp_members*/
+  0,                               /*tp_getset*/
+  0,                               /*tp_base*/
+  0,                               /*tp_dict*/
+  0,                               /*tp_descr_get*/
+  0,                               /*tp_descr_set*/
+  0,                               /*tp_dictoffset*/
+  0,                               /*tp_init*/
+  0,                               /*tp_alloc*/
+  filtered_set_new,                /*tp_new*/
+};
+
+static PyTypeObject StreamIterator_Type2 = {
+  PyObject_HEAD_INIT(NULL)
+#if PY_MAJOR_VERSION < 3
+  0,                               /*ob_size*/
+#endif
+  "_re2.RE2_StreamIterator",       /*tp_name*/
+  sizeof(StreamIteratorObject2),   /*tp_basicsize*/
+  0,                               /*tp_itemsize*/
+  (destructor)stream_iterator_dealloc, /*tp_dealloc*/
+  0,                               /*tp_print*/
+  0,                               /*tp_getattr*/
+  0,                               /*tp_setattr*/
+  0,                               /*tp_compare*/
+  0,                               /*tp_repr*/
+  0,                               /*tp_as_number*/
+  0,                               /*tp_as_sequence*/
+  0,                               /*tp_as_mapping*/
+  0,                               /*tp_hash*/
+  0,                               /*tp_call*/
+  0,                               /*tp_str*/
+  0,                               /*tp_getattro*/
+  _no_setattr,                     /*tp_setattro*/
+  0,                               /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,              /*tp_flags*/
+  "RE2 stream match iterators",    /*tp_doc*/
+  0,                               /*tp_traverse*/
+  0,                               /*tp_clear*/
+  0,                               /*tp_richcompare*/
+  0,                               /*tp_weaklistoffset*/
+  PyObject_SelfIter,               /*tp_iter*/
+  (iternextfunc)stream_iterator_next, /*tp_iternext*/
+};
+
+static PyTypeObject Iterator_Type2 = {
+  PyObject_HEAD_INIT(NULL)
+#if PY_MAJOR_VERSION < 3
+  0,                               /*ob_size*/
+#endif
+  "_re2.RE2_Iterator",             /*tp_name*/
+  sizeof(IteratorObject2),         /*tp_basicsize*/
+  0,                               /*tp_itemsize*/
+  (destructor)iterator_dealloc,    /*tp_dealloc*/
+  0,                               /*tp_print*/
+  0,                               /*tp_getattr*/
+  0,                               /*tp_setattr*/
+  0,                               /*tp_compare*/
+  0,                               /*tp_repr*/
+  0,                               /*tp_as_number*/
+  0,                               /*tp_as_sequence*/
+  0,                               /*tp_as_mapping*/
+  0,                               /*tp_hash*/
+  0,                               /*tp_call*/
+  0,                               /*tp_str*/
+  0,                               /*tp_getattro*/
+  _no_setattr,                     /*tp_setattro*/
+  0,                               /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,              /*tp_flags*/
+  "RE2 match iterators",           /*tp_doc*/
+  0,                               /*tp_traverse*/
+  0,                               /*tp_clear*/
+  0,                               /*tp_richcompare*/
+  0,                               /*tp_weaklistoffset*/
+  PyObject_SelfIter,               /*tp_iter*/
+  (iternextfunc)iterator_next,     /*tp_iternext*/
+  0,                               /*tp_methods*/
+  0,                               /*tp_members*/
+  0,                               /*tp_getset*/
+  0,                               /*tp_base*/
+  0,                               /*tp_dict*/
+  0,                               /*tp_descr_get*/
+  0,                               /*tp_descr_set*/
+  0,                               /*tp_dictoffset*/
+  0,                               /*tp_init*/
+  0,                               /*tp_alloc*/
+  0,                               /*tp_new*/
+};
+
+static PySequenceMethods array_as_sequence = {
+  (lenfunc)array_length,           /*sq_length*/
+  0,                               /*sq_concat*/
+  0,                               /*sq_repeat*/
+  (ssizeargfunc)array_item,        /*sq_item*/
+};
+
+static PyBufferProcs array_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+  0,                               /*bf_getreadbuffer*/
+  0,                               /*bf_getwritebuffer*/
+  0,                               /*bf_getsegcount*/
+  0,                               /*bf_getcharbuffer*/
+#endif
+  (getbufferproc)array_getbuffer,  /*bf_getbuffer*/
+  0,                               /*bf_releasebuffer*/
+};
+
+static PyTypeObject Array_Type2 = {
+  PyObject_HEAD_INIT(NULL)
+#if PY_MAJOR_VERSION < 3
+  0,                               /*ob_size*/
+#endif
+  "_re2.RE2_Array",                /*tp_name*/
+  sizeof(ArrayObject2),            /*tp_basicsize*/
+  0,                               /*tp_itemsize*/
+  (destructor)array_dealloc,       /*tp_dealloc*/
+  0,                               /*tp_print*/
+  0,                               /*tp_getattr*/
+  0,                               /*tp_setattr*/
+  0,                               /*tp_compare*/
+  0,                               /*tp_repr*/
+  0,                               /*tp_as_number*/
+  &array_as_sequence,              /*tp_as_sequence*/
+  0,                               /*tp_as_mapping*/
+  0,                               /*tp_hash*/
+  0,                               /*tp_call*/
+  0,                               /*tp_str*/
+  0,                               /*tp_getattro*/
+  _no_setattr,                     /*tp_setattro*/
+  &array_as_buffer,                /*tp_as_buffer*/
+#if PY_MAJOR_VERSION < 3
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+#else
+  Py_TPFLAGS_DEFAULT,              /*tp_flags*/
+#endif
+  "RE2 integer arrays",            /*tp_doc*/
+};
+
 // getters for MatchObject2
 static PyObject*
 match_pos_get(MatchObject2* self)
@@ -376,34 +991,8 @@ regexp_groups_get(RegexpObject2* self)
 static PyObject*
 regexp_groupindex_get(RegexpObject2* self)
 {
-  if (self->groupindex == NULL) {
-    PyObject* groupindex = PyDict_New();
-    if (groupindex == NULL) {
-      return NULL;
-    }
-
-    const std::map<std::string, int>& name_map = self->re2_obj->NamedCapturingGroups();
-    for (std::map<std::string, int>::const_iterator it = name_map.begin(); it != name_map.end(); ++it) {
-      // This used to return an int() on Py2, but now returns a long() to be
-      // consistent across Py3 and Py2.
-      PyObject* index = PyLong_FromLong(it->second);
-      if (index == NULL) {
-        Py_DECREF(groupindex);
-        return NULL;
-      }
-
-      int res = PyDict_SetItemString(groupindex, it->first.c_str(), index);
-      Py_DECREF(index);
-      if (res < 0) {
-        Py_DECREF(groupindex);
-        return NULL;
-      }
-    }
-    self->groupindex = groupindex;
-  }
-
-  Py_INCREF(self->groupindex);
-  return self->groupindex;
+  // Read-only, as lookups by name depend on it.
+  return PyDictProxy_New(self->groupindex);
 }
 
 static PyObject* regexp_pattern_get(RegexpObject2* self)
@@ -412,313 +1001,1829 @@ static PyObject* regexp_pattern_get(RegexpObject2* self)
   return self->pattern;
 }
 
-static void
-regexp_dealloc(RegexpObject2* self)
-{
-  delete self->re2_obj;
-  Py_XDECREF(self->pattern);
-  Py_XDECREF(self->groupindex);
-  PyObject_Del(self);
-}
+// The boolean RE2::Options that can be passed to compile and Set by name.
+typedef struct _BoolOption {
+  const char* name;
+  bool (RE2::Options::*get)() const;
+  void (RE2::Options::*set)(bool);
+} BoolOption;
+
+static const BoolOption bool_options[] = {
+  {"posix_syntax", &RE2::Options::posix_syntax, &RE2::Options::set_posix_syntax},
+  {"longest_match", &RE2::Options::longest_match, &RE2::Options::set_longest_match},
+  {"literal", &RE2::Options::literal, &RE2::Options::set_literal},
+  {"never_nl", &RE2::Options::never_nl, &RE2::Options::set_never_nl},
+  {"dot_nl", &RE2::Options::dot_nl, &RE2::Options::set_dot_nl},
+  {"never_capture", &RE2::Options::never_capture, &RE2::Options::set_never_capture},
+  {"case_sensitive", &RE2::Options::case_sensitive, &RE2::Options::set_case_sensitive},
+  {"perl_classes", &RE2::Options::perl_classes, &RE2::Options::set_perl_classes},
+  {"word_boundary", &RE2::Options::word_boundary, &RE2::Options::set_word_boundary},
+  {"one_line", &RE2::Options::one_line, &RE2::Options::set_one_line},
+};
 
-static PyObject*
-create_regexp(PyObject* self, PyObject* pattern, PyObject* error_class)
+#define N_BOOL_OPTIONS ((int)(sizeof(bool_options) / sizeof(bool_options[0])))
+
+/**
+ * Fill in options from re flags and then from the keyword arguments in kwds
+ * (which may be NULL).  Keys listed in skip are left for the caller.
+ * Return false on failure (exception).
+ */
+static bool
+_parse_options(int flags, PyObject* kwds, const char* const* skip, RE2::Options* options)
 {
-  RegexpObject2* regexp = PyObject_New(RegexpObject2, &Regexp_Type2);
-  if (regexp == NULL) {
-    return NULL;
+  options->set_log_errors(false);
+
+  if (flags & ~SUPPORTED_FLAGS) {
+    PyErr_Format(PyExc_ValueError, "unsupported flags: %d", flags & ~SUPPORTED_FLAGS);
+    return false;
+  }
+  if (flags & FLAG_IGNORECASE) {
+    options->set_case_sensitive(false);
+  }
+  if (flags & FLAG_DOTALL) {
+    options->set_dot_nl(true);
+  }
+  if (flags & FLAG_MULTILINE) {
+    // For Perl syntax, see _multiline_prefix.
+    options->set_one_line(false);
   }
-  regexp->pattern = NULL;
-  regexp->re2_obj = NULL;
-  regexp->groupindex = NULL;
 
-  Py_ssize_t len_pattern;
+  Py_ssize_t i = 0;
+  PyObject* key;
+  PyObject* value;
+  while (kwds != NULL && PyDict_Next(kwds, &i, &key, &value)) {
 #if PY_MAJOR_VERSION >= 3
-  const char* raw_pattern = PyUnicode_AsUTF8AndSize(pattern, &len_pattern);
+    const char* name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
 #else
-  const char* raw_pattern = PyString_AS_STRING(pattern);
-  len_pattern = PyString_GET_SIZE(pattern);
+    const char* name = PyString_Check(key) ? PyString_AsString(key) : NULL;
 #endif
+    if (name == NULL) {
+      PyErr_Clear();
+      PyErr_SetString(PyExc_TypeError, "keywords must be strings");
+      return false;
+    }
+    bool skipped = false;
+    for (const char* const* s = skip; s != NULL && *s != NULL; s++) {
+      skipped = skipped || strcmp(name, *s) == 0;
+    }
+    if (skipped) {
+      continue;
+    }
 
-  RE2::Options options;
-  options.set_log_errors(false);
-
-  regexp->re2_obj = new(nothrow) RE2(StringPiece(raw_pattern, (int)len_pattern), options);
+    if (strcmp(name, "max_mem") == 0) {
+      PY_LONG_LONG max_mem = PyLong_AsLongLong(value);
+      if (max_mem == -1 && PyErr_Occurred()) {
+        return false;
+      }
+      if (max_mem <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_mem must be positive");
+        return false;
+      }
+      options->set_max_mem(max_mem);
+      continue;
+    }
 
-  if (regexp->re2_obj == NULL) {
-    PyErr_NoMemory();
-    Py_DECREF(regexp);
-    return NULL;
+    int j = 0;
+    while (j < N_BOOL_OPTIONS && strcmp(name, bool_options[j].name) != 0) {
+      j++;
+    }
+    if (j == N_BOOL_OPTIONS) {
+      PyErr_Format(PyExc_TypeError, "'%s' is an invalid option", name);
+      return false;
+    }
+    int truth = PyObject_IsTrue(value);
+    if (truth < 0) {
+      return false;
+    }
+    (options->*bool_options[j].set)(truth != 0);
+  }
+  if ((flags & FLAG_ASCII) && !options->case_sensitive()) {
+    // RE2 always folds case by Unicode rules ('\u017f' matches 's'), so
+    // it can't give re's ASCII-only IGNORECASE.
+    PyErr_SetString(PyExc_ValueError, "ASCII can't be combined with IGNORECASE");
+    return false;
   }
+  return true;
+}
 
-  if (!regexp->re2_obj->ok()) {
-    const std::string& msg = regexp->re2_obj->error();
-#if PY_MAJOR_VERSION >= 3
-    PyObject* value = PyUnicode_FromStringAndSize(msg.data(), msg.length());
-#else
-    long code = (long)regexp->re2_obj->error_code();
-    PyObject* value = Py_BuildValue("ls#", code, msg.data(), msg.length());
-#endif
-    if (value == NULL) {
-      Py_DECREF(regexp);
-      return NULL;
+/**
+ * Return a hashable summary of options, for use in cache keys.
+ */
+static PyObject*
+_options_key(const RE2::Options& options)
+{
+  long bits = 0;
+  for (int j = 0; j < N_BOOL_OPTIONS; j++) {
+    if ((options.*bool_options[j].get)()) {
+      bits |= 1L << j;
     }
-    PyErr_SetObject(error_class, value);
-    Py_DECREF(regexp);
-    return NULL;
   }
-
-  Py_INCREF(pattern);
-  regexp->pattern = pattern;
-  regexp->groups = regexp->re2_obj->NumberOfCapturingGroups();
-  regexp->groupindex = NULL;
-  return (PyObject*)regexp;
+  return Py_BuildValue("Ll", (PY_LONG_LONG)options.max_mem(), bits);
 }
 
 static PyObject*
-_do_search(RegexpObject2* self, PyObject* args, PyObject* kwds, RE2::Anchor anchor, bool return_match)
+regexp_flags_get(RegexpObject2* self)
 {
-  PyObject* string;
-  long pos = 0;
-  long endpos = LONG_MAX;
+  return PyLong_FromLong(self->flags);
+}
 
-  static const char* kwlist[] = {
-    "string",
-    "pos",
-    "endpos",
-    NULL};
+static PyObject*
+regexp_options_get(RegexpObject2* self)
+{
+  const RE2::Options& options = self->re2_obj->options();
+  PyObject* dict = Py_BuildValue("{sL}", "max_mem", (PY_LONG_LONG)options.max_mem());
+  for (int j = 0; dict != NULL && j < N_BOOL_OPTIONS; j++) {
+    PyObject* value = (options.*bool_options[j].get)() ? Py_True : Py_False;
+    if (PyDict_SetItemString(dict, bool_options[j].name, value) < 0) {
+      Py_CLEAR(dict);
+    }
+  }
+  return dict;
+}
 
-  // Using O instead of s# here, because we want to stash the original
-  // PyObject* in the match object on a successful match.
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ll", (char**)kwlist,
-        &string,
-        &pos, &endpos)) {
-    return NULL;
+static void
+regexp_dealloc(RegexpObject2* self)
+{
+  delete self->re2_obj;
+  delete self->re2_latin1;
+  delete self->re2_longest;
+  delete self->re2_latin1_longest;
+  Py_XDECREF(self->pattern);
+  Py_XDECREF(self->groupindex);
+  Py_XDECREF(self->error_class);
+  Py_XDECREF(self->templates);
+  Py_XDECREF(self->cache_key);
+  PyObject_Del(self);
+}
+
+/**
+ * Return whether patterns compiled with flags and options need
+ * MULTILINE_PREFIX.  Only Perl syntax does: POSIX syntax gets one_line
+ * from _parse_options instead, and literal patterns have no ^ or $.
+ */
+static bool
+_multiline_prefix(int flags, const RE2::Options& options)
+{
+  return (flags & FLAG_MULTILINE) && !options.posix_syntax() && !options.literal();
+}
+
+/**
+ * Store the pattern RE2 should compile for pattern in effective, with
+ * MULTILINE_PREFIX in front if prefix is true.  Return false on failure
+ * (exception).
+ */
+static bool
+_effective_pattern(PyObject* pattern, bool prefix, std::string* effective)
+{
+  // Patterns aren't worth caching a UTF-8 copy of on the str.
+  Subject raw_pattern;
+  if (!_subject_get(pattern, &raw_pattern, "expected str pattern", false)) {
+    return false;
+  }
+  effective->clear();
+  if (prefix) {
+    effective->append(MULTILINE_PREFIX);
+  }
+  effective->append(raw_pattern.data, raw_pattern.size);
+  _subject_release(&raw_pattern);
+  return true;
+}
+
+/**
+ * Return the message for error, from compiling effective with options.
+ * The prefix can't make a pattern bad, so if effective has one, the
+ * message comes from compiling the pattern without it instead: that way
+ * it only ever quotes what the caller wrote.
+ */
+static std::string
+_pattern_error(const std::string& effective, bool prefix, const RE2::Options& options,
+    const std::string& error)
+{
+  if (!prefix) {
+    return error;
   }
+  RE2 re(effective.substr(sizeof(MULTILINE_PREFIX) - 1), options);
+  return re.ok() ? error : re.error();
+}
 
-  const char *subject;
-  Py_ssize_t slen;
-#if PY_MAJOR_VERSION >= 3
-  if (PyUnicode_Check(string)) {
-    subject = PyUnicode_AsUTF8AndSize(string, &slen);
-  } else if (PyBytes_Check(string)) {
-    subject = PyBytes_AS_STRING(string);
-    slen = PyBytes_GET_SIZE(string);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "can only operate on unicode or bytes");
+/**
+ * Build the groupindex dict of a compiled regexp.
+ */
+static PyObject*
+_build_groupindex(const RE2* re2_obj)
+{
+  PyObject* groupindex = PyDict_New();
+  if (groupindex == NULL) {
     return NULL;
   }
+  const std::map<int, std::string>& group_names = re2_obj->CapturingGroupNames();
+  for (std::map<int, std::string>::const_iterator it = group_names.begin(); it != group_names.end(); ++it) {
+#if PY_MAJOR_VERSION >= 3
+    PyObject* name = PyUnicode_InternFromString(it->second.c_str());
 #else
-  subject = PyString_AsString(string);
-  if (subject == NULL) {
-    return NULL;
-  }
-  slen = PyString_GET_SIZE(string);
+    PyObject* name = PyString_InternFromString(it->second.c_str());
 #endif
-  if (pos < 0) pos = 0;
-  if (pos > slen) pos = slen;
-  if (endpos < pos) endpos = pos;
-  if (endpos > slen) endpos = slen;
-
-  // Don't bother allocating these if we are just doing a test.
-  int n_groups = 0;
-  StringPiece* groups = NULL;
-  if (return_match) {
-    n_groups = self->re2_obj->NumberOfCapturingGroups() + 1;
-    groups = new(nothrow) StringPiece[n_groups];
-
-    if (groups == NULL) {
-      PyErr_NoMemory();
+    // This used to return an int() on Py2, but now returns a long() to be
+    // consistent across Py3 and Py2.
+    PyObject* index = name != NULL ? PyLong_FromLong(it->first) : NULL;
+    int res = index != NULL ? PyDict_SetItem(groupindex, name, index) : -1;
+    Py_XDECREF(name);
+    Py_XDECREF(index);
+    if (res < 0) {
+      Py_DECREF(groupindex);
       return NULL;
     }
   }
+  return groupindex;
+}
 
-  bool matched = self->re2_obj->Match(
-      StringPiece(subject, (int)slen),
-      (int)pos,
-      (int)endpos,
-      anchor,
-      groups,
-      n_groups);
+/**
+ * Return a new regexp object for re2_obj, the compiled form of pattern,
+ * taking ownership of it.  If re2_obj is NULL or failed to compile, raise
+ * and return NULL instead.
+ */
+static PyObject*
+_wrap_regexp(PyObject* pattern, PyObject* error_class, int flags, RE2* re2_obj)
+{
+  if (re2_obj == NULL) {
+    return PyErr_NoMemory();
+  }
 
-  if (!return_match) {
-    if (matched) {
-      Py_RETURN_TRUE;
+  if (!re2_obj->ok()) {
+    std::string msg = _pattern_error(re2_obj->pattern(),
+        _multiline_prefix(flags, re2_obj->options()), re2_obj->options(), re2_obj->error());
+#if PY_MAJOR_VERSION >= 3
+    PyObject* value = PyUnicode_FromStringAndSize(msg.data(), msg.length());
+#else
+    long code = (long)re2_obj->error_code();
+    PyObject* value = Py_BuildValue("ls#", code, msg.data(), msg.length());
+#endif
+    delete re2_obj;
+    if (value == NULL) {
+      return NULL;
     }
-    Py_RETURN_FALSE;
+    PyErr_SetObject(error_class, value);
+    Py_DECREF(value);
+    return NULL;
   }
 
-  if (!matched) {
-    delete[] groups;
-    Py_RETURN_NONE;
+  RegexpObject2* regexp = PyObject_New(RegexpObject2, &Regexp_Type2);
+  if (regexp == NULL) {
+    delete re2_obj;
+    return NULL;
   }
-
-  return create_match((PyObject*)self, string, pos, endpos, groups);
+  regexp->re2_obj = re2_obj;
+  regexp->re2_latin1 = NULL;
+  regexp->latin1_tried = false;
+  regexp->re2_longest = NULL;
+  regexp->re2_latin1_longest = NULL;
+  regexp->longest_tried = false;
+  regexp->latin1_longest_tried = false;
+  regexp->templates = NULL;
+  regexp->cache_key = NULL;
+  regexp->cache_newer = NULL;
+  regexp->cache_older = NULL;
+  Py_INCREF(pattern);
+  regexp->pattern = pattern;
+  Py_INCREF(error_class);
+  regexp->error_class = error_class;
+  regexp->flags = flags;
+  regexp->groups = re2_obj->NumberOfCapturingGroups();
+  regexp->groupindex = _build_groupindex(re2_obj);
+  if (regexp->groupindex == NULL) {
+    Py_DECREF(regexp);
+    return NULL;
+  }
+  return (PyObject*)regexp;
 }
 
 static PyObject*
-regexp_search(RegexpObject2* self, PyObject* args, PyObject* kwds)
+create_regexp(PyObject* self, PyObject* pattern, PyObject* error_class,
+    int flags, const RE2::Options& options)
 {
-  return _do_search(self, args, kwds, RE2::UNANCHORED, true);
+  std::string effective;
+  if (!_effective_pattern(pattern, _multiline_prefix(flags, options), &effective)) {
+    return NULL;
+  }
+  return _wrap_regexp(pattern, error_class, flags, new(nothrow) RE2(effective, options));
 }
 
-static PyObject*
-regexp_match(RegexpObject2* self, PyObject* args, PyObject* kwds)
+static Utf8Index*
+_utf8_index_new(const char* data, Py_ssize_t size)
 {
-  return _do_search(self, args, kwds, RE2::ANCHOR_START, true);
+  Utf8Index* index = new(nothrow) Utf8Index;
+  if (index == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  index->refcnt = 1;
+  index->data = data;
+  index->size = size;
+  index->checkpoints.push_back(0);
+  return index;
 }
 
-static PyObject*
-regexp_fullmatch(RegexpObject2* self, PyObject* args, PyObject* kwds)
+static void
+_utf8_index_decref(Utf8Index* index)
 {
-  return _do_search(self, args, kwds, RE2::ANCHOR_BOTH, true);
+  if (index != NULL && --index->refcnt == 0) {
+    delete index;
+  }
 }
 
-static PyObject*
-regexp_test_search(RegexpObject2* self, PyObject* args, PyObject* kwds)
+/**
+ * Advance n code points from byte offset b, stopping at the end.
+ */
+static Py_ssize_t
+_utf8_advance(const Utf8Index* index, Py_ssize_t b, Py_ssize_t n)
 {
-  return _do_search(self, args, kwds, RE2::UNANCHORED, false);
+  const unsigned char* data = (const unsigned char*)index->data;
+  while (n > 0 && b < index->size) {
+    unsigned char c = data[b];
+    b += 1 + (c >= 0xC0) + (c >= 0xE0) + (c >= 0xF0);
+    n--;
+  }
+  return b < index->size ? b : index->size;
 }
 
-static PyObject*
-regexp_test_match(RegexpObject2* self, PyObject* args, PyObject* kwds)
+/**
+ * Record the checkpoint one stride past the last one.  Return false once
+ * the end of the subject has been reached: a partial stride at the end is
+ * never recorded.
+ */
+static bool
+_utf8_index_grow(Utf8Index* index)
 {
-  return _do_search(self, args, kwds, RE2::ANCHOR_START, false);
+  Py_ssize_t next = _utf8_advance(index, index->checkpoints.back(), UTF8_INDEX_STRIDE);
+  if (next == index->size) {
+    return false;
+  }
+  index->checkpoints.push_back(next);
+  return true;
 }
 
-static PyObject*
-regexp_test_fullmatch(RegexpObject2* self, PyObject* args, PyObject* kwds)
+static Py_ssize_t
+_utf8_index_to_code_point(Utf8Index* index, Py_ssize_t b)
 {
-  return _do_search(self, args, kwds, RE2::ANCHOR_BOTH, false);
+  std::vector<Py_ssize_t>& checkpoints = index->checkpoints;
+  while (checkpoints.back() <= b && _utf8_index_grow(index)) {
+  }
+  size_t i = std::upper_bound(checkpoints.begin(), checkpoints.end(), b) - checkpoints.begin() - 1;
+  Py_ssize_t cp = (Py_ssize_t)i * UTF8_INDEX_STRIDE;
+  for (Py_ssize_t j = checkpoints[i]; j < b; j++) {
+    cp += (index->data[j] & 0xC0) != 0x80;
+  }
+  return cp;
 }
 
+static Py_ssize_t
+_utf8_index_to_byte(Utf8Index* index, Py_ssize_t cp)
+{
+  std::vector<Py_ssize_t>& checkpoints = index->checkpoints;
+  size_t i = cp / UTF8_INDEX_STRIDE;
+  while (checkpoints.size() <= i && _utf8_index_grow(index)) {
+  }
+  if (i >= checkpoints.size()) {
+    i = checkpoints.size() - 1;
+  }
+  return _utf8_advance(index, checkpoints[i], cp - (Py_ssize_t)i * UTF8_INDEX_STRIDE);
+}
 
-static void
-match_dealloc(MatchObject2* self)
+/**
+ * Get the bytes to match from a str, bytes, or buffer-protocol object.
+ * Return false on failure (exception).  On success the subject must be
+ * released with _subject_release unless its view is handed off.
+ *
+ * Non-ASCII str subjects are matched in UTF-8.  If cache_utf8 is false,
+ * the UTF-8 form of a 1-byte (Latin-1) str is built just for this subject
+ * rather than kept alive with the str, which would double its footprint.
+ */
+static bool
+_subject_get(PyObject* string, Subject* subject, const char* type_error, bool cache_utf8)
 {
-  Py_DECREF(self->re);
-  Py_DECREF(self->string);
-  delete[] self->groups;
-  PyObject_Del(self);
+  subject->view.obj = NULL;
+  subject->utf8_str = false;
+  subject->encoded = NULL;
+#if PY_MAJOR_VERSION >= 3
+  if (PyUnicode_Check(string)) {
+    if (PyUnicode_READY(string) < 0) {
+      return false;
+    }
+    if (!cache_utf8 && PyUnicode_KIND(string) == PyUnicode_1BYTE_KIND &&
+        !PyUnicode_IS_ASCII(string)) {
+      subject->encoded = PyUnicode_AsUTF8String(string);
+      if (subject->encoded == NULL) {
+        return false;
+      }
+      subject->data = PyBytes_AS_STRING(subject->encoded);
+      subject->size = PyBytes_GET_SIZE(subject->encoded);
+    } else {
+      subject->data = PyUnicode_AsUTF8AndSize(string, &subject->size);
+      if (subject->data == NULL) {
+        return false;
+      }
+    }
+    subject->utf8_str = subject->size != PyUnicode_GET_LENGTH(string);
+    return true;
+  }
+  if (PyBytes_Check(string)) {
+    subject->data = PyBytes_AS_STRING(string);
+    subject->size = PyBytes_GET_SIZE(string);
+    return true;
+  }
+#else
+  if (PyString_Check(string)) {
+    subject->data = PyString_AS_STRING(string);
+    subject->size = PyString_GET_SIZE(string);
+    return true;
+  }
+#endif
+  if (!PyObject_CheckBuffer(string)) {
+    PyErr_SetString(PyExc_TypeError, type_error);
+    return false;
+  }
+  if (PyObject_GetBuffer(string, &subject->view, PyBUF_SIMPLE) < 0) {
+    subject->view.obj = NULL;
+    return false;
+  }
+  if (subject->view.itemsize != 1) {
+    // Offsets into the subject must also be valid indexes into the object.
+    PyBuffer_Release(&subject->view);
+    PyErr_SetString(PyExc_TypeError, "buffer subjects must have an item size of 1");
+    return false;
+  }
+  subject->data = (const char*)subject->view.buf;
+  subject->size = subject->view.len;
+  return true;
 }
 
-static PyObject*
-create_match(PyObject* re, PyObject* string,
-    long pos, long endpos,
-    StringPiece* groups)
+static void
+_subject_release(Subject* subject)
 {
-  MatchObject2* match = PyObject_New(MatchObject2, &Match_Type2);
-  if (match == NULL) {
-    delete[] groups;
-    return NULL;
+  if (subject->view.obj != NULL) {
+    PyBuffer_Release(&subject->view);
   }
-  match->re = NULL;
-  match->groups = NULL;
-  match->string = NULL;
+  Py_XDECREF(subject->encoded);
+}
 
-  match->groups = groups;
-  Py_INCREF(re);
-  match->re = re;
-  Py_INCREF(string);
-  match->string = string;
-  match->pos = pos;
-  match->endpos = endpos;
+/**
+ * Return the Latin-1 program for self, compiling it on first use, or NULL
+ * if the pattern has no Latin-1 equivalent.  Never raises.
+ */
+static RE2*
+_regexp_latin1(RegexpObject2* self)
+{
+#if PY_MAJOR_VERSION >= 3
+  if (!self->latin1_tried) {
+    self->latin1_tried = true;
+    // A pattern with characters beyond U+00FF can't be written in Latin-1.
+    // (A 1-byte subject could never match such characters anyway, but
+    // classes and escapes make that hard to decide, so just fall back.)
+    if (PyUnicode_KIND(self->pattern) == PyUnicode_1BYTE_KIND) {
+      RE2::Options options(self->re2_obj->options());
+      options.set_encoding(RE2::Options::EncodingLatin1);
+      std::string effective;
+      if (_multiline_prefix(self->flags, options)) {
+        effective = MULTILINE_PREFIX;
+      }
+      effective.append((const char*)PyUnicode_1BYTE_DATA(self->pattern),
+          PyUnicode_GET_LENGTH(self->pattern));
+      RE2* re = new(nothrow) RE2(effective, options);
+      if (re != NULL && (!re->ok() || re->NumberOfCapturingGroups() != self->groups)) {
+        delete re;
+        re = NULL;
+      }
+      self->re2_latin1 = re;
+    }
+  }
+#endif
+  return self->re2_latin1;
+}
 
-  return (PyObject*)match;
+/**
+ * Convert a pos or endpos argument.  Out-of-range values are clamped
+ * rather than rejected, just as they are clamped to the subject later.
+ */
+static bool
+_index_arg(PyObject* obj, Py_ssize_t* value)
+{
+  *value = PyNumber_AsSsize_t(obj, NULL);
+  return !(*value == -1 && PyErr_Occurred() != NULL);
 }
 
 /**
- * Attempt to convert an untrusted group index (PyObject* group) into
- * a trusted one (*idx_p).  Return false on failure (exception).
+ * Parse the (string[, pos[, endpos]]) arguments shared by the search
+ * methods.  Return false on failure (exception).
  */
+#ifdef HAVE_FASTCALL
 static bool
-_group_idx(MatchObject2* self, PyObject* group, long* idx_p)
+_parse_search_args(SEARCH_PARAMS, const char* fname,
+    PyObject** string, Py_ssize_t* pos, Py_ssize_t* endpos)
 {
-  if (group == NULL) {
+  static const char* kwlist[] = {
+    "string",
+    "pos",
+    "endpos",
+    NULL};
+  const Py_ssize_t nparams = 3;
+
+  if (nargs > nparams) {
+    PyErr_Format(PyExc_TypeError,
+        "%s() takes at most %zd arguments (%zd given)", fname, nparams, nargs);
     return false;
   }
-  PyErr_Clear(); // Is this necessary?
-  long idx = PyLong_AsLong(group);
-  if (idx == -1 && PyErr_Occurred() != NULL) {
+
+  PyObject* values[3] = {NULL, NULL, NULL};
+  for (Py_ssize_t i = 0; i < nargs; i++) {
+    values[i] = args[i];
+  }
+
+  // Positional-only calls never get here, which keeps the common case to a
+  // couple of pointer copies.
+  if (kwnames != NULL) {
+    Py_ssize_t nkw = PyTuple_GET_SIZE(kwnames);
+    for (Py_ssize_t k = 0; k < nkw; k++) {
+      PyObject* key = PyTuple_GET_ITEM(kwnames, k);
+      Py_ssize_t i = 0;
+      while (i < nparams && PyUnicode_CompareWithASCIIString(key, kwlist[i]) != 0) {
+        i++;
+      }
+      if (i == nparams) {
+        PyErr_Format(PyExc_TypeError,
+            "%s() got an unexpected keyword argument '%U'", fname, key);
+        return false;
+      }
+      if (values[i] != NULL) {
+        PyErr_Format(PyExc_TypeError,
+            "argument for %s() given by name ('%s') and position (%zd)",
+            fname, kwlist[i], i + 1);
+        return false;
+      }
+      values[i] = args[nargs + k];
+    }
+  }
+
+  if (values[0] == NULL) {
+    PyErr_Format(PyExc_TypeError,
+        "%s() missing required argument 'string' (pos 1)", fname);
     return false;
   }
-  // TODO: Consider caching NumberOfCapturingGroups.
-  if (idx < 0 || idx > ((RegexpObject2*)self->re)->re2_obj->NumberOfCapturingGroups()) {
-    PyErr_SetString(PyExc_IndexError, "no such group");
+  *string = values[0];
+
+  if (values[1] != NULL && !_index_arg(values[1], pos)) {
+    return false;
+  }
+  if (values[2] != NULL && !_index_arg(values[2], endpos)) {
+    return false;
+  }
+  return true;
+}
+#else
+static bool
+_parse_search_args(SEARCH_PARAMS, const char* fname,
+    PyObject** string, Py_ssize_t* pos, Py_ssize_t* endpos)
+{
+  static const char* kwlist[] = {
+    "string",
+    "pos",
+    "endpos",
+    NULL};
+  PyObject* pos_obj = NULL;
+  PyObject* endpos_obj = NULL;
+  (void)fname;
+
+  // Using O instead of s# here, because we want to stash the original
+  // PyObject* in the match object on a successful match.
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", (char**)kwlist,
+        string, &pos_obj, &endpos_obj)) {
+    return false;
+  }
+  if (pos_obj != NULL && !_index_arg(pos_obj, pos)) {
+    return false;
+  }
+  if (endpos_obj != NULL && !_index_arg(endpos_obj, endpos)) {
     return false;
   }
-  *idx_p = idx;
   return true;
 }
+#endif
 
 /**
- * Extract the start and end indexes of a pre-checked group number.
- * Sets both to -1 if it did not participate in the match.
+ * Prepare string for matching against self between pos and endpos.
+ * Return false on failure (exception).  On success the state must be
+ * released with _search_state_release.
  */
 static bool
-_group_span(MatchObject2* self, long idx, Py_ssize_t* o_start, Py_ssize_t* o_end)
+_search_state_init(RegexpObject2* self, PyObject* string,
+    Py_ssize_t pos, Py_ssize_t endpos, SearchState* state)
 {
-  // "idx" is expected to be verified.
-  StringPiece& piece = self->groups[idx];
-  if (piece.data() == NULL) {
-    *o_start = -1;
-    *o_end = -1;
+  Subject* subject = &state->subject;
+  state->re = self->re2_obj;
+  state->index = NULL;
+  state->longest = NULL;
+  state->after_empty = false;
+#if PY_MAJOR_VERSION >= 3
+  // Latin-1 str subjects are matched in place when the pattern allows it,
+  // so they never need a UTF-8 copy and offsets are already code points.
+  if (PyUnicode_Check(string) && PyUnicode_READY(string) == 0 &&
+      PyUnicode_KIND(string) == PyUnicode_1BYTE_KIND &&
+      !PyUnicode_IS_ASCII(string) && _regexp_latin1(self) != NULL) {
+    state->re = self->re2_latin1;
+    subject->data = (const char*)PyUnicode_1BYTE_DATA(string);
+    subject->size = PyUnicode_GET_LENGTH(string);
+    subject->view.obj = NULL;
+    subject->utf8_str = false;
+    subject->encoded = NULL;
+  } else
+#endif
+  if (!_subject_get(string, subject, "can only operate on unicode or bytes-like objects", true)) {
     return false;
   }
-  Py_ssize_t start;
+
+  Py_ssize_t slen = subject->size;
 #if PY_MAJOR_VERSION >= 3
-  if (PyBytes_Check(self->string)) {
-    start = piece.data() - PyBytes_AS_STRING(self->string);
-  } else {
-    start = piece.data() - PyUnicode_AsUTF8AndSize(self->string, NULL);
+  if (subject->utf8_str) {
+    slen = PyUnicode_GET_LENGTH(string);
   }
-#else
-  start = piece.data() - PyString_AS_STRING(self->string);
 #endif
-  *o_start = start;
-  *o_end = start + piece.length();
+  if (pos < 0) pos = 0;
+  if (pos > slen) pos = slen;
+  if (endpos < pos) endpos = pos;
+  if (endpos > slen) endpos = slen;
+  state->pos = pos;
+  state->endpos = endpos;
+
+  state->byte_pos = pos;
+  state->byte_endpos = endpos;
+  if (subject->utf8_str) {
+    state->byte_endpos = subject->size;
+    if (pos > 0 || endpos < slen) {
+      state->index = _utf8_index_new(subject->data, subject->size);
+      if (state->index == NULL) {
+        _subject_release(subject);
+        return false;
+      }
+      state->byte_pos = _utf8_index_to_byte(state->index, pos);
+      state->byte_endpos = _utf8_index_to_byte(state->index, endpos);
+    }
+  }
   return true;
 }
 
+static void
+_search_state_release(SearchState* state)
+{
+  _subject_release(&state->subject);
+  _utf8_index_decref(state->index);
+}
+
 /**
- * Return a pre-checked group number as a string, or default_obj
- * if it didn't participate in the match.
+ * Match state's subject from byte offset start to the end of its range.
+ * Must be called with the GIL held; it is released for large scans.
  */
-static PyObject*
-_group_get_i(MatchObject2* self, long idx, PyObject* default_obj)
+static bool
+_search_state_match(SearchState* state, Py_ssize_t start, RE2::Anchor anchor,
+    StringPiece* groups, int n_groups)
 {
-  Py_ssize_t start;
-  Py_ssize_t end;
-  if (!_group_span(self, idx, &start, &end)) {
-    Py_INCREF(default_obj);
-    return default_obj;
+  // The subject is either an immutable str or bytes that the caller holds a
+  // reference to, or a buffer we hold a view of, so its memory stays valid
+  // while the GIL is released.
+  StringPiece text(state->subject.data, state->subject.size);
+  bool matched;
+  if (state->byte_endpos - start >= GIL_RELEASE_THRESHOLD) {
+    Py_BEGIN_ALLOW_THREADS
+    matched = state->re->Match(text, start, state->byte_endpos, anchor, groups, n_groups);
+    Py_END_ALLOW_THREADS
+  } else {
+    matched = state->re->Match(text, start, state->byte_endpos, anchor, groups, n_groups);
   }
-  return PySequence_GetSlice(self->string, start, end);
+  return matched;
 }
 
 /**
- * Return n un-checked group number as a string.
+ * Return whether re can match the empty string anywhere.  Whether it can
+ * depends only on the characters either side (through ^, $, \b and the
+ * like), so it is enough to try a word character, a non-word character, a
+ * newline and the edge of the text on each side.
  */
-static PyObject*
-_group_get_o(MatchObject2* self, PyObject* group)
+static bool
+_regexp_can_match_empty(const RE2* re)
 {
-  long idx;
-  if (!_group_idx(self, group, &idx)) {
-    return NULL;
+  static const char* const sides[] = {"", "a", " ", "\n"};
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      std::string text(sides[i]);
+      size_t at = text.size();
+      text.append(sides[j]);
+      if (re->Match(text, at, at, RE2::UNANCHORED, NULL, 0)) {
+        return true;
+      }
+    }
   }
-  return _group_get_i(self, idx, Py_None);
+  return false;
 }
 
-
-static PyObject*
-match_group(MatchObject2* self, PyObject* args)
+/**
+ * Return the leftmost-longest version of re, one of self's programs,
+ * compiling it on first use, or NULL if re can't match empty (or the
+ * program can't be built).  It tells whether a non-empty match starts
+ * where an empty one ended.  Must be called with the GIL held.  Never
+ * raises.
+ */
+static const RE2*
+_regexp_longest(RegexpObject2* self, const RE2* re)
 {
-  long idx = 0;
-  Py_ssize_t nargs = PyTuple_GET_SIZE(args);
-  switch (nargs) {
-    case 1:
-      if (!_group_idx(self, PyTuple_GET_ITEM(args, 0), &idx)) {
-        return NULL;
+  bool latin1 = re != self->re2_obj;
+  RE2** longest = latin1 ? &self->re2_latin1_longest : &self->re2_longest;
+  bool* tried = latin1 ? &self->latin1_longest_tried : &self->longest_tried;
+  if (!*tried) {
+    *tried = true;
+    if (_regexp_can_match_empty(re)) {
+      RE2::Options options(re->options());
+      options.set_longest_match(true);
+      RE2* compiled = new(nothrow) RE2(re->pattern(), options);
+      if (compiled != NULL && !compiled->ok()) {
+        delete compiled;
+        compiled = NULL;
+      }
+      *longest = compiled;
+    }
+  }
+  return *longest;
+}
+
+/**
+ * Ready state for a scan with _search_state_next.  Must be called with the
+ * GIL held.  Never raises.
+ */
+static void
+_search_state_prepare_scan(RegexpObject2* self, SearchState* state)
+{
+  state->longest = _regexp_longest(self, state->re);
+}
+
+/**
+ * Return the byte offset just past the character at byte offset b.
+ */
+static Py_ssize_t
+_search_state_next_char(const SearchState* state, Py_ssize_t b)
+{
+  b++;
+  if (state->subject.utf8_str) {
+    while (b < state->subject.size && (state->subject.data[b] & 0xC0) == 0x80) {
+      b++;
+    }
+  }
+  return b;
+}
+
+/**
+ * Find the next non-overlapping match at or after byte offset *next, then
+ * move *next past it.  groups must have room for at least one submatch.
+ * Safe to call without the GIL.
+ *
+ * As in Python 3.7+, a match may be empty, even right after a non-empty
+ * one, but after an empty match the next one must either be non-empty or
+ * start later.  re takes the first non-empty match there in leftmost-first
+ * order, which RE2 can't search for: its programs can't be told to skip the
+ * empty one.  So where an empty match ended, the longest match is taken
+ * instead if it is non-empty, otherwise the scan resumes one character on.
+ * This differs from re when a shorter non-empty match would be preferred,
+ * as with lazy quantifiers or shorter alternatives first: 'a*?' finds
+ * ['', '', 'aa', '', ''] in 'baac' where re finds
+ * ['', '', 'a', '', 'a', '', ''].  state must have been prepared with
+ * _search_state_prepare_scan.
+ */
+static bool
+_search_state_next(SearchState* state, Py_ssize_t* next, StringPiece* groups, int n_groups)
+{
+  if (*next > state->byte_endpos) {
+    return false;
+  }
+  StringPiece text(state->subject.data, state->subject.size);
+  if (state->after_empty) {
+    state->after_empty = false;
+    if (state->longest != NULL &&
+        state->longest->Match(text, *next, state->byte_endpos, RE2::ANCHOR_START, groups, 1) &&
+        !groups[0].empty()) {
+      Py_ssize_t start = *next;
+      Py_ssize_t end = start + groups[0].size();
+      // Take the groups as re would for that span.  The match can't fail,
+      // but if it somehow did, groups[0] would still hold the span.
+      if (n_groups > 1 &&
+          !state->re->Match(text, start, end, RE2::ANCHOR_BOTH, groups, n_groups)) {
+        for (int i = 1; i < n_groups; i++) {
+          groups[i] = StringPiece();
+        }
+      }
+      *next = end;
+      return true;
+    }
+    *next = _search_state_next_char(state, *next);
+    if (*next > state->byte_endpos) {
+      return false;
+    }
+  }
+  if (!state->re->Match(text, *next, state->byte_endpos, RE2::UNANCHORED, groups, n_groups)) {
+    *next = state->byte_endpos + 1;
+    return false;
+  }
+  *next = groups[0].data() - state->subject.data + groups[0].size();
+  state->after_empty = groups[0].empty();
+  return true;
+}
+
+/**
+ * Return a new str/bytes/... for the bytes [start, end) of state's subject,
+ * the same type that slicing string would produce.
+ */
+static PyObject*
+_search_state_slice(const SearchState* state, PyObject* string, Py_ssize_t start, Py_ssize_t end)
+{
+  if (state->subject.utf8_str) {
+    // Decoding the matched UTF-8 is as cheap as slicing the str, and needs
+    // no code point offsets.
+    return PyUnicode_DecodeUTF8(state->subject.data + start, end - start, NULL);
+  }
+  return PySequence_GetSlice(string, start, end);
+}
+
+static PyObject*
+_do_search(RegexpObject2* self, SEARCH_PARAMS, const char* fname, RE2::Anchor anchor, bool return_match)
+{
+  PyObject* string;
+  Py_ssize_t pos = 0;
+  Py_ssize_t endpos = PY_SSIZE_T_MAX;
+
+  if (!_parse_search_args(SEARCH_ARGS, fname, &string, &pos, &endpos)) {
+    return NULL;
+  }
+
+  SearchState state;
+  if (!_search_state_init(self, string, pos, endpos, &state)) {
+    return NULL;
+  }
+
+  // Don't bother with submatches if we are just doing a test.  Otherwise
+  // only ask for the overall match, which RE2 can find with the DFA alone;
+  // the match extracts the groups if and when they are needed.
+  StringPiece match;
+  int n_groups = return_match ? 1 : 0;
+  bool matched = _search_state_match(&state, state.byte_pos, anchor, &match, n_groups);
+
+  PyObject* ret;
+  if (!return_match) {
+    ret = matched ? Py_True : Py_False;
+    Py_INCREF(ret);
+  } else if (!matched) {
+    ret = Py_None;
+    Py_INCREF(ret);
+  } else {
+    ret = create_match((PyObject*)self, string, &state, &match, n_groups);
+  }
+  _search_state_release(&state);
+  return ret;
+}
+
+static PyObject*
+regexp_search(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "search", RE2::UNANCHORED, true);
+}
+
+static PyObject*
+regexp_match(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "match", RE2::ANCHOR_START, true);
+}
+
+static PyObject*
+regexp_fullmatch(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "fullmatch", RE2::ANCHOR_BOTH, true);
+}
+
+static PyObject*
+regexp_test_search(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "test_search", RE2::UNANCHORED, false);
+}
+
+static PyObject*
+regexp_test_match(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "test_match", RE2::ANCHOR_START, false);
+}
+
+static PyObject*
+regexp_test_fullmatch(RegexpObject2* self, SEARCH_PARAMS)
+{
+  return _do_search(self, SEARCH_ARGS, "test_fullmatch", RE2::ANCHOR_BOTH, false);
+}
+
+static PyObject*
+regexp_finditer(RegexpObject2* self, SEARCH_PARAMS)
+{
+  PyObject* string;
+  Py_ssize_t pos = 0;
+  Py_ssize_t endpos = PY_SSIZE_T_MAX;
+
+  if (!_parse_search_args(SEARCH_ARGS, "finditer", &string, &pos, &endpos)) {
+    return NULL;
+  }
+
+  IteratorObject2* it = PyObject_New(IteratorObject2, &Iterator_Type2);
+  if (it == NULL) {
+    return NULL;
+  }
+  it->re = NULL;
+  it->string = NULL;
+  it->groups = NULL;
+  if (!_search_state_init(self, string, pos, endpos, &it->state)) {
+    PyObject_Del(it);
+    return NULL;
+  }
+  _search_state_prepare_scan(self, &it->state);
+  Py_INCREF(self);
+  it->re = (PyObject*)self;
+  Py_INCREF(string);
+  it->string = string;
+  it->next = it->state.byte_pos;
+
+  // Only the overall matches are found while iterating; see create_match.
+  it->groups = new(nothrow) StringPiece[1];
+  if (it->groups == NULL) {
+    Py_DECREF(it);
+    return PyErr_NoMemory();
+  }
+  return (PyObject*)it;
+}
+
+static void
+iterator_dealloc(IteratorObject2* self)
+{
+  if (self->re != NULL) {
+    _search_state_release(&self->state);
+  }
+  Py_XDECREF(self->re);
+  Py_XDECREF(self->string);
+  delete[] self->groups;
+  PyObject_Del(self);
+}
+
+static PyObject*
+iterator_next(IteratorObject2* self)
+{
+  bool matched;
+  if (self->state.byte_endpos - self->next >= GIL_RELEASE_THRESHOLD) {
+    Py_BEGIN_ALLOW_THREADS
+    matched = _search_state_next(&self->state, &self->next, self->groups, 1);
+    Py_END_ALLOW_THREADS
+  } else {
+    matched = _search_state_next(&self->state, &self->next, self->groups, 1);
+  }
+  if (!matched) {
+    // Returning NULL without an exception ends the iteration.
+    return NULL;
+  }
+  return create_match(self->re, self->string, &self->state, self->groups, 1);
+}
+
+/**
+ * Append the findall() item for a match to list: the whole match, the one
+ * group, or a tuple of all groups.  Groups that didn't participate are
+ * reported as empty strings, as re does.
+ */
+static bool
+_findall_append(SearchState* state, PyObject* string, PyObject* list,
+    const Py_ssize_t* spans, int n_groups)
+{
+  int first = n_groups == 1 ? 0 : 1;
+  PyObject* item = NULL;
+  if (n_groups > 2) {
+    item = PyTuple_New(n_groups - 1);
+    if (item == NULL) {
+      return false;
+    }
+  }
+  for (int i = first; i < n_groups; i++) {
+    Py_ssize_t start = spans[2 * i];
+    Py_ssize_t end = spans[2 * i + 1];
+    if (start == -1) {
+      start = end = 0;
+    }
+    PyObject* group = _search_state_slice(state, string, start, end);
+    if (group == NULL) {
+      Py_XDECREF(item);
+      return false;
+    }
+    if (n_groups <= 2) {
+      item = group;
+    } else {
+      PyTuple_SET_ITEM(item, i - 1, group);
+    }
+  }
+  int res = PyList_Append(list, item);
+  Py_DECREF(item);
+  return res == 0;
+}
+
+static PyObject*
+regexp_findall(RegexpObject2* self, SEARCH_PARAMS)
+{
+  PyObject* string;
+  Py_ssize_t pos = 0;
+  Py_ssize_t endpos = PY_SSIZE_T_MAX;
+
+  if (!_parse_search_args(SEARCH_ARGS, "findall", &string, &pos, &endpos)) {
+    return NULL;
+  }
+
+  SearchState state;
+  if (!_search_state_init(self, string, pos, endpos, &state)) {
+    return NULL;
+  }
+  _search_state_prepare_scan(self, &state);
+
+  // Scan the whole subject first, recording the byte spans of every match,
+  // so that the GIL can be released for the entire scan.
+  int n_groups = self->groups + 1;
+  std::vector<StringPiece> groups(n_groups);
+  std::vector<Py_ssize_t> spans;
+  Py_ssize_t next = state.byte_pos;
+  bool release = state.byte_endpos - state.byte_pos >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  while (_search_state_next(&state, &next, &groups[0], n_groups)) {
+    for (int i = 0; i < n_groups; i++) {
+      if (groups[i].data() == NULL) {
+        spans.push_back(-1);
+        spans.push_back(-1);
+      } else {
+        Py_ssize_t start = groups[i].data() - state.subject.data;
+        spans.push_back(start);
+        spans.push_back(start + groups[i].size());
+      }
+    }
+  }
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+
+  Py_ssize_t n_matches = spans.size() / (2 * n_groups);
+  PyObject* list = PyList_New(0);
+  if (list == NULL) {
+    _search_state_release(&state);
+    return NULL;
+  }
+  for (Py_ssize_t m = 0; m < n_matches; m++) {
+    if (!_findall_append(&state, string, list, &spans[2 * n_groups * m], n_groups)) {
+      Py_DECREF(list);
+      list = NULL;
+      break;
+    }
+  }
+  _search_state_release(&state);
+  return list;
+}
+
+static PyObject*
+regexp_split(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {
+    "string",
+    "maxsplit",
+    NULL};
+
+  PyObject* string;
+  Py_ssize_t maxsplit = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n:split", (char**)kwlist,
+        &string, &maxsplit)) {
+    return NULL;
+  }
+
+  SearchState state;
+  if (!_search_state_init(self, string, 0, PY_SSIZE_T_MAX, &state)) {
+    return NULL;
+  }
+  _search_state_prepare_scan(self, &state);
+
+  // As in findall, record the byte spans of every match without the GIL,
+  // then build the list at its final size.
+  int n_groups = self->groups + 1;
+  std::vector<StringPiece> groups(n_groups);
+  std::vector<Py_ssize_t> spans;
+  Py_ssize_t next = 0;
+  Py_ssize_t n_matches = 0;
+  bool release = state.byte_endpos >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  while ((maxsplit == 0 || n_matches < maxsplit) &&
+      _search_state_next(&state, &next, &groups[0], n_groups)) {
+    for (int i = 0; i < n_groups; i++) {
+      if (groups[i].data() == NULL) {
+        spans.push_back(-1);
+        spans.push_back(-1);
+      } else {
+        Py_ssize_t start = groups[i].data() - state.subject.data;
+        spans.push_back(start);
+        spans.push_back(start + groups[i].size());
+      }
+    }
+    n_matches++;
+  }
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+
+  // Each match contributes the piece before it and its groups.
+  PyObject* list = PyList_New(n_matches * n_groups + 1);
+  if (list == NULL) {
+    _search_state_release(&state);
+    return NULL;
+  }
+  Py_ssize_t last = 0;
+  Py_ssize_t item = 0;
+  for (Py_ssize_t m = 0; m < n_matches; m++) {
+    const Py_ssize_t* span = &spans[2 * n_groups * m];
+    PyObject* piece = _search_state_slice(&state, string, last, span[0]);
+    if (piece == NULL) {
+      goto error;
+    }
+    PyList_SET_ITEM(list, item++, piece);
+    for (int i = 1; i < n_groups; i++) {
+      if (span[2 * i] == -1) {
+        Py_INCREF(Py_None);
+        piece = Py_None;
+      } else {
+        piece = _search_state_slice(&state, string, span[2 * i], span[2 * i + 1]);
+        if (piece == NULL) {
+          goto error;
+        }
+      }
+      PyList_SET_ITEM(list, item++, piece);
+    }
+    last = span[1];
+  }
+  {
+    PyObject* piece = _search_state_slice(&state, string, last, state.subject.size);
+    if (piece == NULL) {
+      goto error;
+    }
+    PyList_SET_ITEM(list, item, piece);
+  }
+  _search_state_release(&state);
+  return list;
+
+error:
+  Py_DECREF(list);
+  _search_state_release(&state);
+  return NULL;
+}
+
+// A parsed sub() template: literal text (in the subject's encoding)
+// interleaved with group references.  Each piece is some literal text
+// followed by the contents of a group, or of no group if group is -1.
+typedef struct _TemplatePiece {
+  std::string literal;
+  int group;
+} TemplatePiece;
+
+typedef std::vector<TemplatePiece> Template;
+
+// Bound on the number of parsed templates cached on each regexp.
+#define TEMPLATE_CACHE_MAX 64
+
+static void
+_template_capsule_destructor(PyObject* capsule)
+{
+  delete (Template*)PyCapsule_GetPointer(capsule, "_re2.template");
+}
+
+/**
+ * Append code point c to a literal, as UTF-8 if str is true.
+ */
+static void
+_template_append_char(std::string* out, unsigned int c, bool str)
+{
+  if (str && c >= 0x80) {
+    out->push_back((char)(0xC0 | (c >> 6)));
+    out->push_back((char)(0x80 | (c & 0x3F)));
+  } else {
+    out->push_back((char)c);
+  }
+}
+
+/**
+ * Parse a replacement template with the same syntax as re: \n-style
+ * escapes, \0 and three-digit octal escapes, and group references as \N,
+ * \NN, \g<N> or \g<name>.  data is UTF-8 if str is true.  Return false on
+ * failure (exception).
+ */
+static bool
+_template_parse(RegexpObject2* self, const char* data, Py_ssize_t size, bool str,
+    Template* tmpl)
+{
+  TemplatePiece piece;
+  piece.group = -1;
+  Py_ssize_t i = 0;
+  while (i < size) {
+    char c = data[i++];
+    if (c != '\\') {
+      piece.literal.push_back(c);
+      continue;
+    }
+    if (i == size) {
+      PyErr_SetString(self->error_class, "bad escape (end of pattern)");
+      return false;
+    }
+    c = data[i++];
+    long group = -1;
+    if (c == 'g') {
+      if (i == size || data[i] != '<') {
+        PyErr_SetString(self->error_class, "missing <");
+        return false;
+      }
+      const char* name = data + i + 1;
+      const char* close = (const char*)memchr(name, '>', data + size - name);
+      if (close == NULL) {
+        PyErr_SetString(self->error_class, "missing >, unterminated name");
+        return false;
+      }
+      std::string name_str(name, close - name);
+      i = close + 1 - data;
+      const std::map<std::string, int>& name_map = self->re2_obj->NamedCapturingGroups();
+      std::map<std::string, int>::const_iterator it = name_map.find(name_str);
+      if (it != name_map.end()) {
+        group = it->second;
+      } else if (!name_str.empty() &&
+          name_str.find_first_not_of("0123456789") == std::string::npos) {
+        group = name_str.size() > 9 ? LONG_MAX : atol(name_str.c_str());
+      } else if (!name_str.empty() &&
+          name_str.find_first_not_of("_0123456789abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ") == std::string::npos &&
+          !isdigit((unsigned char)name_str[0])) {
+        PyErr_Format(PyExc_IndexError, "unknown group name '%s'", name_str.c_str());
+        return false;
+      } else {
+        PyErr_Format(self->error_class, "bad character in group name '%s'", name_str.c_str());
+        return false;
+      }
+    } else if (c == '0') {
+      unsigned int value = 0;
+      for (int n = 0; n < 2 && i < size && data[i] >= '0' && data[i] <= '7'; n++) {
+        value = value * 8 + (data[i++] - '0');
+      }
+      _template_append_char(&piece.literal, value & 0xff, str);
+      continue;
+    } else if (c >= '1' && c <= '9') {
+      group = c - '0';
+      if (i < size && isdigit((unsigned char)data[i])) {
+        char d = data[i++];
+        if (c <= '7' && d <= '7' && i < size && data[i] >= '0' && data[i] <= '7') {
+          unsigned int value = (c - '0') * 64 + (d - '0') * 8 + (data[i++] - '0');
+          if (value > 0377) {
+            PyErr_Format(self->error_class,
+                "octal escape value \\%c%c%c outside of range 0-0o377", c, d, data[i - 1]);
+            return false;
+          }
+          _template_append_char(&piece.literal, value, str);
+          continue;
+        }
+        group = group * 10 + (d - '0');
+      }
+    } else {
+      const char* escapes = "a\ab\bf\fn\nr\rt\tv\v\\\\";
+      const char* e = strchr(escapes, c);
+      if (c != '\0' && e != NULL && (e - escapes) % 2 == 0) {
+        piece.literal.push_back(e[1]);
+      } else if (isalpha((unsigned char)c) && (unsigned char)c < 0x80) {
+        PyErr_Format(self->error_class, "bad escape \\%c", c);
+        return false;
+      } else {
+        // Unknown escapes of punctuation are kept as they are.
+        piece.literal.push_back('\\');
+        piece.literal.push_back(c);
+      }
+      continue;
+    }
+    if (group > self->groups) {
+      PyErr_Format(self->error_class, "invalid group reference %ld", group);
+      return false;
+    }
+    piece.group = (int)group;
+    tmpl->push_back(piece);
+    piece.literal.clear();
+    piece.group = -1;
+  }
+  if (!piece.literal.empty() || tmpl->empty()) {
+    tmpl->push_back(piece);
+  }
+  return true;
+}
+
+/**
+ * Return a capsule holding the parsed form of template repl, from the
+ * regexp's cache if possible.  str says whether the subject (and so the
+ * template) is a str.  Return NULL on failure (exception).
+ */
+static PyObject*
+_template_get(RegexpObject2* self, PyObject* repl, bool str)
+{
+  PyObject* capsule = NULL;
+  // Only immutable templates can be cached.
+  bool hashable = PyUnicode_CheckExact(repl) || PyBytes_CheckExact(repl);
+  if (self->templates != NULL && hashable) {
+    capsule = PyDict_GetItem(self->templates, repl);
+    if (capsule != NULL) {
+      Py_INCREF(capsule);
+      return capsule;
+    }
+  }
+
+  Subject raw;
+  if (str != (bool)PyUnicode_Check(repl)) {
+    PyErr_SetString(PyExc_TypeError, str
+        ? "expected str replacement for a str subject"
+        : "expected a bytes-like replacement for a bytes-like subject");
+    return NULL;
+  }
+  if (!_subject_get(repl, &raw, "expected str or a bytes-like replacement", false)) {
+    return NULL;
+  }
+  Template* tmpl = new(nothrow) Template;
+  if (tmpl == NULL) {
+    _subject_release(&raw);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  bool ok = _template_parse(self, raw.data, raw.size, str, tmpl);
+  _subject_release(&raw);
+  if (!ok) {
+    delete tmpl;
+    return NULL;
+  }
+
+  capsule = PyCapsule_New(tmpl, "_re2.template", _template_capsule_destructor);
+  if (capsule == NULL) {
+    delete tmpl;
+    return NULL;
+  }
+  if (hashable) {
+    if (self->templates == NULL) {
+      self->templates = PyDict_New();
+    } else if (PyDict_Size(self->templates) >= TEMPLATE_CACHE_MAX) {
+      PyDict_Clear(self->templates);
+    }
+    if (self->templates == NULL || PyDict_SetItem(self->templates, repl, capsule) < 0) {
+      Py_DECREF(capsule);
+      return NULL;
+    }
+  }
+  return capsule;
+}
+
+/**
+ * Append the bytes [start, end) of state's subject to out.  Latin-1
+ * subjects are transcoded, since str output is always built as UTF-8.
+ */
+static void
+_sub_append_subject(std::string* out, const SearchState* state, bool latin1,
+    Py_ssize_t start, Py_ssize_t end)
+{
+  const char* data = state->subject.data;
+  if (!latin1) {
+    out->append(data + start, end - start);
+    return;
+  }
+  for (Py_ssize_t i = start; i < end; i++) {
+    _template_append_char(out, (unsigned char)data[i], true);
+  }
+}
+
+/**
+ * Append the expansion of tmpl for the match in groups to out.
+ */
+static void
+_sub_expand(std::string* out, const SearchState* state, bool latin1,
+    const Template* tmpl, const StringPiece* groups)
+{
+  for (size_t i = 0; i < tmpl->size(); i++) {
+    const TemplatePiece& piece = (*tmpl)[i];
+    out->append(piece.literal);
+    if (piece.group >= 0 && groups[piece.group].data() != NULL) {
+      Py_ssize_t start = groups[piece.group].data() - state->subject.data;
+      _sub_append_subject(out, state, latin1, start, start + groups[piece.group].size());
+    }
+  }
+}
+
+/**
+ * Append the result of calling repl with a match object to out.
+ * *match is reused between calls unless the callable kept a reference.
+ */
+static bool
+_sub_call(std::string* out, RegexpObject2* self, PyObject* string,
+    SearchState* state, PyObject* repl, PyObject** match,
+    const StringPiece* groups, int n_groups)
+{
+  if (*match != NULL && Py_REFCNT(*match) == 1) {
+    _match_set_spans((MatchObject2*)*match, state->subject.data, groups, n_groups);
+  } else {
+    Py_XDECREF(*match);
+    *match = create_match((PyObject*)self, string, state, groups, n_groups);
+    if (*match == NULL) {
+      return false;
+    }
+  }
+
+  PyObject* result = PyObject_CallFunctionObjArgs(repl, *match, NULL);
+  if (result == NULL) {
+    return false;
+  }
+  if (result == Py_None) {
+    Py_DECREF(result);
+    return true;
+  }
+  bool str = PyUnicode_Check(string);
+  if (str != (bool)PyUnicode_Check(result)) {
+    PyErr_Format(PyExc_TypeError, "expected %s, got %.200s",
+        str ? "str" : "a bytes-like object", Py_TYPE(result)->tp_name);
+    Py_DECREF(result);
+    return false;
+  }
+  Subject piece;
+  bool ok = _subject_get(result, &piece, "expected str or a bytes-like object", false);
+  if (ok) {
+    out->append(piece.data, piece.size);
+    _subject_release(&piece);
+  }
+  Py_DECREF(result);
+  return ok;
+}
+
+static PyObject*
+_do_sub(RegexpObject2* self, PyObject* args, PyObject* kwds, const char* format, bool return_count)
+{
+  static const char* kwlist[] = {
+    "repl",
+    "string",
+    "count",
+    NULL};
+
+  PyObject* repl;
+  PyObject* string;
+  Py_ssize_t count = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, format, (char**)kwlist,
+        &repl, &string, &count)) {
+    return NULL;
+  }
+
+  SearchState state;
+  if (!_search_state_init(self, string, 0, PY_SSIZE_T_MAX, &state)) {
+    return NULL;
+  }
+  _search_state_prepare_scan(self, &state);
+  bool str = PyUnicode_Check(string);
+  // Latin-1 str subjects are matched with the second program.
+  bool latin1 = state.re != self->re2_obj;
+
+  PyObject* capsule = NULL;
+  const Template* tmpl = NULL;
+  if (!PyCallable_Check(repl)) {
+    capsule = _template_get(self, repl, str);
+    if (capsule == NULL) {
+      _search_state_release(&state);
+      return NULL;
+    }
+    tmpl = (const Template*)PyCapsule_GetPointer(capsule, "_re2.template");
+  }
+
+  int n_groups = self->groups + 1;
+  std::vector<StringPiece> groups(n_groups);
+  std::string out;
+  Py_ssize_t n_subs = 0;
+  Py_ssize_t last = 0;
+  Py_ssize_t next = 0;
+  PyObject* match = NULL;
+  bool ok = true;
+
+  // Template expansion needs no Python objects, so the whole substitution
+  // can run without the GIL.  Callables need it for every match.
+  bool release = tmpl != NULL && state.byte_endpos >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  while ((count == 0 || n_subs < count) &&
+      _search_state_next(&state, &next, &groups[0], n_groups)) {
+    Py_ssize_t start = groups[0].data() - state.subject.data;
+    _sub_append_subject(&out, &state, latin1, last, start);
+    if (tmpl != NULL) {
+      _sub_expand(&out, &state, latin1, tmpl, &groups[0]);
+    } else if (!_sub_call(&out, self, string, &state, repl, &match, &groups[0], n_groups)) {
+      ok = false;
+      break;
+    }
+    last = start + groups[0].size();
+    n_subs++;
+  }
+  if (ok) {
+    _sub_append_subject(&out, &state, latin1, last, state.subject.size);
+  }
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+  Py_XDECREF(match);
+  Py_XDECREF(capsule);
+
+  PyObject* result = NULL;
+  if (ok) {
+    if (n_subs == 0 && (PyUnicode_CheckExact(string) || PyBytes_CheckExact(string))) {
+      Py_INCREF(string);
+      result = string;
+    } else if (str) {
+      result = PyUnicode_DecodeUTF8(out.data(), out.size(), NULL);
+    } else {
+      result = PyBytes_FromStringAndSize(out.data(), out.size());
+    }
+  }
+  _search_state_release(&state);
+  if (result == NULL || !return_count) {
+    return result;
+  }
+  return Py_BuildValue("Nn", result, n_subs);
+}
+
+static PyObject*
+regexp_sub(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  return _do_sub(self, args, kwds, "OO|n:sub", false);
+}
+
+static PyObject*
+regexp_subn(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  return _do_sub(self, args, kwds, "OO|n:subn", true);
+}
+
+
+static void
+match_dealloc(MatchObject2* self)
+{
+  Py_XDECREF(self->re);
+  Py_XDECREF(self->string);
+  if (self->view.obj != NULL) {
+    PyBuffer_Release(&self->view);
+  }
+  _utf8_index_decref(self->index);
+
+  Py_ssize_t n_groups = MATCH_NGROUPS(self);
+  if (n_groups <= MATCH_FREELIST_MAXGROUPS &&
+      match_freelist_len[n_groups - 1] < MATCH_FREELIST_MAXLEN) {
+    self->re = (PyObject*)match_freelist[n_groups - 1];
+    match_freelist[n_groups - 1] = self;
+    match_freelist_len[n_groups - 1]++;
+    return;
+  }
+  PyObject_Del(self);
+}
+
+/**
+ * Record the submatches found in subject as match's group offsets.
+ */
+static void
+_match_set_spans(MatchObject2* match, const char* subject,
+    const StringPiece* groups, int n_groups)
+{
+  match->lazy_re = NULL;
+  for (int i = 0; i < n_groups; i++) {
+    const StringPiece& piece = groups[i];
+    if (piece.data() == NULL) {
+      match->spans[2 * i] = -1;
+      match->spans[2 * i + 1] = -1;
+    } else {
+      match->spans[2 * i] = piece.data() - subject;
+      match->spans[2 * i + 1] = piece.data() - subject + piece.size();
+    }
+  }
+}
+
+/**
+ * Create a match from the submatches found in state's subject.  If fewer
+ * than all the regexp's groups are given (normally just group 0), the rest
+ * are extracted when first needed.
+ */
+static PyObject*
+create_match(PyObject* re, PyObject* string, SearchState* state,
+    const StringPiece* groups, int n_found)
+{
+  int n_groups = ((RegexpObject2*)re)->groups + 1;
+  // Non-ASCII str subjects need an index to translate offsets.  It lives
+  // on the state so that every match from the same scan shares it.
+  if (state->subject.utf8_str && state->index == NULL) {
+    state->index = _utf8_index_new(state->subject.data, state->subject.size);
+    if (state->index == NULL) {
+      return NULL;
+    }
+  }
+
+  MatchObject2* match;
+  if (n_groups <= MATCH_FREELIST_MAXGROUPS && match_freelist[n_groups - 1] != NULL) {
+    match = match_freelist[n_groups - 1];
+    match_freelist[n_groups - 1] = (MatchObject2*)match->re;
+    match_freelist_len[n_groups - 1]--;
+    PyObject_InitVar((PyVarObject*)match, &Match_Type2, 2 * n_groups);
+  } else {
+    match = PyObject_NewVar(MatchObject2, &Match_Type2, 2 * n_groups);
+    if (match == NULL) {
+      return NULL;
+    }
+  }
+
+  // Buffer subjects are pinned by a view of the match's own.
+  match->view.obj = NULL;
+  if (state->subject.view.obj != NULL &&
+      PyObject_GetBuffer(string, &match->view, PyBUF_SIMPLE) < 0) {
+    match->view.obj = NULL;
+    match->re = NULL;
+    match->string = NULL;
+    match->index = NULL;
+    match_dealloc(match);
+    return NULL;
+  }
+  match->index = state->index;
+  if (match->index != NULL) {
+    match->index->refcnt++;
+  }
+
+  _match_set_spans(match, state->subject.data, groups, n_found);
+  if (n_found < n_groups) {
+    match->lazy_re = state->re;
+    if (match->view.obj != NULL) {
+      // Our own export of the buffer is the one that stays valid.
+      match->lazy_data = (const char*)match->view.buf;
+      match->lazy_size = match->view.len;
+    } else {
+      match->lazy_data = state->subject.data;
+      match->lazy_size = state->subject.size;
+    }
+  }
+
+  Py_INCREF(re);
+  match->re = re;
+  Py_INCREF(string);
+  match->string = string;
+  match->pos = state->pos;
+  match->endpos = state->endpos;
+
+  return (PyObject*)match;
+}
+
+/**
+ * Extract the groups of a lazy match by rerunning the program anchored at
+ * both ends of the overall match, in the same subject so that ^, $ and \b
+ * see the same context.  Among the ways of matching exactly that range,
+ * this finds the one the original search preferred.
+ */
+static void
+_match_resolve(MatchObject2* self)
+{
+  const RE2* re = self->lazy_re;
+  if (re == NULL) {
+    return;
+  }
+  int n_groups = MATCH_NGROUPS(self);
+  StringPiece stack_groups[SEARCH_STACK_GROUPS];
+  std::vector<StringPiece> heap_groups;
+  StringPiece* groups = stack_groups;
+  if (n_groups > SEARCH_STACK_GROUPS) {
+    heap_groups.resize(n_groups);
+    groups = &heap_groups[0];
+  }
+
+  // The subject stays valid while the GIL is released: the match holds a
+  // reference to it and, for buffers, an export.
+  StringPiece text(self->lazy_data, self->lazy_size);
+  Py_ssize_t start = self->spans[0];
+  Py_ssize_t end = self->spans[1];
+  bool matched;
+  if (end - start >= GIL_RELEASE_THRESHOLD) {
+    Py_BEGIN_ALLOW_THREADS
+    matched = re->Match(text, start, end, RE2::ANCHOR_BOTH, groups, n_groups);
+    Py_END_ALLOW_THREADS
+    if (self->lazy_re == NULL) {
+      // Another thread got there first.
+      return;
+    }
+  } else {
+    matched = re->Match(text, start, end, RE2::ANCHOR_BOTH, groups, n_groups);
+  }
+  if (!matched) {
+    // Can't happen, but leave the overall match intact if it does.
+    groups[0] = StringPiece(text.data() + start, end - start);
+    for (int i = 1; i < n_groups; i++) {
+      groups[i] = StringPiece();
+    }
+  }
+  _match_set_spans(self, self->lazy_data, groups, n_groups);
+}
+
+/**
+ * Attempt to convert an untrusted group index (PyObject* group) into
+ * a trusted one (*idx_p).  Return false on failure (exception).
+ */
+static bool
+_group_idx(MatchObject2* self, PyObject* group, long* idx_p)
+{
+  if (group == NULL) {
+    return false;
+  }
+  PyErr_Clear(); // Is this necessary?
+  if (PyUnicode_Check(group) || PyBytes_Check(group)) {
+    PyObject* index = PyDict_GetItem(((RegexpObject2*)self->re)->groupindex, group);
+    if (index == NULL) {
+      PyErr_SetString(PyExc_IndexError, "no such group");
+      return false;
+    }
+    group = index;
+  }
+  long idx = PyLong_AsLong(group);
+  if (idx == -1 && PyErr_Occurred() != NULL) {
+    return false;
+  }
+  if (idx < 0 || idx >= MATCH_NGROUPS(self)) {
+    PyErr_SetString(PyExc_IndexError, "no such group");
+    return false;
+  }
+  *idx_p = idx;
+  return true;
+}
+
+/**
+ * Extract the start and end indexes of a pre-checked group number.
+ * Sets both to -1 if it did not participate in the match.
+ */
+static bool
+_group_span(MatchObject2* self, long idx, Py_ssize_t* o_start, Py_ssize_t* o_end)
+{
+  // "idx" is expected to be verified.
+  if (idx > 0) {
+    _match_resolve(self);
+  }
+  *o_start = self->spans[2 * idx];
+  *o_end = self->spans[2 * idx + 1];
+  if (*o_start == -1) {
+    return false;
+  }
+  if (self->index != NULL) {
+    *o_start = _utf8_index_to_code_point(self->index, *o_start);
+    *o_end = _utf8_index_to_code_point(self->index, *o_end);
+  }
+  return true;
+}
+
+/**
+ * Return a pre-checked group number as a string, or default_obj
+ * if it didn't participate in the match.
+ */
+static PyObject*
+_group_get_i(MatchObject2* self, long idx, PyObject* default_obj)
+{
+  if (idx > 0) {
+    _match_resolve(self);
+  }
+  Py_ssize_t start = self->spans[2 * idx];
+  Py_ssize_t end = self->spans[2 * idx + 1];
+  if (start == -1) {
+    Py_INCREF(default_obj);
+    return default_obj;
+  }
+  if (self->index != NULL) {
+    // Decoding the matched UTF-8 is as cheap as slicing the str, and needs
+    // no code point offsets.
+    return PyUnicode_DecodeUTF8(self->index->data + start, end - start, NULL);
+  }
+  return PySequence_GetSlice(self->string, start, end);
+}
+
+/**
+ * Return n un-checked group number as a string.
+ */
+static PyObject*
+_group_get_o(MatchObject2* self, PyObject* group)
+{
+  long idx;
+  if (!_group_idx(self, group, &idx)) {
+    return NULL;
+  }
+  return _group_get_i(self, idx, Py_None);
+}
+
+
+static PyObject*
+_do_group(MatchObject2* self, PyObject* const* args, Py_ssize_t nargs)
+{
+  long idx = 0;
+  switch (nargs) {
+    case 1:
+      if (!_group_idx(self, args[0], &idx)) {
+        return NULL;
       }
       // Fall through.
     case 0:
@@ -729,297 +2834,2420 @@ match_group(MatchObject2* self, PyObject* args)
         return NULL;
       }
 
-      for (int i = 0; i < nargs; i++) {
-        PyObject* group = _group_get_o(self, PyTuple_GET_ITEM(args, i));
-        if (group == NULL) {
-          Py_DECREF(ret);
-          return NULL;
+      for (int i = 0; i < nargs; i++) {
+        PyObject* group = _group_get_o(self, args[i]);
+        if (group == NULL) {
+          Py_DECREF(ret);
+          return NULL;
+        }
+        PyTuple_SET_ITEM(ret, i, group);
+      }
+      return ret;
+  }
+}
+
+static PyObject*
+match_group(MatchObject2* self, ACCESSOR_PARAMS)
+{
+  return _do_group(self, ACCESSOR_ARGS);
+}
+
+static PyObject*
+match_groups(MatchObject2* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {
+    "default",
+    NULL};
+
+  PyObject* default_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)kwlist,
+        &default_obj)) {
+    return NULL;
+  }
+
+  int ngroups = MATCH_NGROUPS(self) - 1;
+
+  PyObject* ret = PyTuple_New(ngroups);
+  if (ret == NULL) {
+    return NULL;
+  }
+
+  for (int i = 1; i <= ngroups; i++) {
+    PyObject* group = _group_get_i(self, i, default_obj);
+    if (group == NULL) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(ret, i-1, group);
+  }
+
+  return ret;
+}
+
+static PyObject*
+match_groupdict(MatchObject2* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {
+    "default",
+    NULL};
+
+  PyObject* default_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)kwlist,
+        &default_obj)) {
+    return NULL;
+  }
+
+  PyObject* ret = PyDict_New();
+  if (ret == NULL) {
+    return NULL;
+  }
+
+  // The names are shared with groupindex, so their hashes are cached.
+  PyObject* groupindex = ((RegexpObject2*)self->re)->groupindex;
+  Py_ssize_t pos = 0;
+  PyObject* name;
+  PyObject* index;
+  while (PyDict_Next(groupindex, &pos, &name, &index)) {
+    PyObject* group = _group_get_i(self, PyLong_AsLong(index), default_obj);
+    if (group == NULL) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+    int res = PyDict_SetItem(ret, name, group);
+    Py_DECREF(group);
+    if (res < 0) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+  }
+
+  return ret;
+}
+
+enum span_mode_t { START, END, SPAN };
+
+static PyObject*
+_do_span(MatchObject2* self, PyObject* const* args, Py_ssize_t nargs, const char* name, span_mode_t mode)
+{
+  long idx = 0;
+  if (nargs > 1) {
+    PyErr_Format(PyExc_TypeError,
+        "%s expected at most 1 argument, got %zd", name, nargs);
+    return NULL;
+  }
+  if (nargs == 1) {
+    if (!_group_idx(self, args[0], &idx)) {
+      return NULL;
+    }
+  }
+
+  Py_ssize_t start = - 1;
+  Py_ssize_t end = - 1;
+
+  (void)_group_span(self, idx, &start, &end);
+  switch (mode) {
+    case START : return Py_BuildValue("n", start );
+    case END   : return Py_BuildValue("n", end   );
+    case SPAN:
+      return Py_BuildValue("nn", start, end);
+  }
+
+  // Make gcc happy.
+  return NULL;
+}
+
+static PyObject*
+match_start(MatchObject2* self, ACCESSOR_PARAMS)
+{
+  return _do_span(self, ACCESSOR_ARGS, "start", START);
+}
+
+static PyObject*
+match_end(MatchObject2* self, ACCESSOR_PARAMS)
+{
+  return _do_span(self, ACCESSOR_ARGS, "end", END);
+}
+
+static PyObject*
+match_span(MatchObject2* self, ACCESSOR_PARAMS)
+{
+  return _do_span(self, ACCESSOR_ARGS, "span", SPAN);
+}
+
+static PyObject*
+match_spans(MatchObject2* self)
+{
+  Py_ssize_t n_groups = MATCH_NGROUPS(self);
+  std::vector<PY_LONG_LONG> spans(n_groups * 2);
+  for (Py_ssize_t i = 0; i < n_groups; i++) {
+    Py_ssize_t start, end;
+    (void)_group_span(self, i, &start, &end);
+    spans[2 * i] = start;
+    spans[2 * i + 1] = end;
+  }
+  return create_array(spans, 'q');
+}
+
+static PyObject*
+match_group_view(MatchObject2* self, ACCESSOR_PARAMS)
+{
+  long idx = 0;
+  if (nargs > 1) {
+    PyErr_Format(PyExc_TypeError,
+        "group_view expected at most 1 argument, got %zd", nargs);
+    return NULL;
+  }
+  if (nargs == 1 && !_group_idx(self, args[0], &idx)) {
+    return NULL;
+  }
+  if (PyUnicode_Check(self->string)) {
+    PyErr_SetString(PyExc_TypeError, "group_view() requires a bytes-like subject");
+    return NULL;
+  }
+  if (idx > 0) {
+    _match_resolve(self);
+  }
+  Py_ssize_t start = self->spans[2 * idx];
+  Py_ssize_t end = self->spans[2 * idx + 1];
+  if (start == -1) {
+    Py_RETURN_NONE;
+  }
+
+  // A view of the subject itself, so that it stays alive and, for buffers,
+  // exported, for as long as the slice does.
+  PyObject* view = PyMemoryView_FromObject(self->string);
+  if (view == NULL) {
+    return NULL;
+  }
+#if PY_MAJOR_VERSION >= 3
+  Py_buffer* buffer = PyMemoryView_GET_BUFFER(view);
+  if (buffer->ndim != 1 || buffer->format == NULL || strcmp(buffer->format, "B") != 0) {
+    // Offsets are into the subject's bytes, so slice a flat view of them.
+    PyObject* flat = PyObject_CallMethod(view, (char*)"cast", (char*)"s", "B");
+    Py_DECREF(view);
+    if (flat == NULL) {
+      return NULL;
+    }
+    view = flat;
+  }
+#endif
+  PyObject* slice = PySequence_GetSlice(view, start, end);
+  Py_DECREF(view);
+  return slice;
+}
+
+
+static void
+regexp_set_dealloc(RegexpSetObject2* self)
+{
+  delete self->re2_set_obj;
+  delete self->options;
+  PyObject_Del(self);
+}
+
+static PyObject*
+regexp_set_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    int anchoring = RE2::UNANCHORED;
+    int flags = 0;
+    PyObject* anchoring_obj = NULL;
+
+    if (!PyArg_ParseTuple(args, "|Oi:Set", &anchoring_obj, &flags)) {
+      return NULL;
+    }
+    // anchoring and flags may also be passed by keyword; anything else
+    // is an RE2 option.
+    static const char* const set_kwlist[] = {"anchoring", "flags", NULL};
+    PyObject* value;
+    if (kwds != NULL && (value = PyDict_GetItemString(kwds, "anchoring")) != NULL) {
+      anchoring_obj = value;
+    }
+    if (anchoring_obj != NULL) {
+      anchoring = (int)PyLong_AsLong(anchoring_obj);
+      if (anchoring == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+      }
+    }
+    if (kwds != NULL && (value = PyDict_GetItemString(kwds, "flags")) != NULL) {
+      flags = (int)PyLong_AsLong(value);
+      if (flags == -1 && PyErr_Occurred()) {
+        return NULL;
+      }
+    }
+
+    switch (anchoring) {
+      case RE2::UNANCHORED:
+      case RE2::ANCHOR_START:
+      case RE2::ANCHOR_BOTH:
+        break;
+      default:
+        PyErr_SetString(PyExc_ValueError,
+          "anchoring must be one of re2.UNANCHORED, re2.ANCHOR_START, or re2.ANCHOR_BOTH");
+        return NULL;
+    }
+
+    RE2::Options options;
+    if (!_parse_options(flags, kwds, set_kwlist, &options)) {
+      return NULL;
+    }
+
+    RegexpSetObject2* self = (RegexpSetObject2*)type->tp_alloc(type, 0);
+
+    if (self == NULL) {
+      return NULL;
+    }
+    self->compiled = false;
+    self->flags = flags;
+    self->size = 0;
+    self->busy = false;
+    self->re2_set_obj = NULL;
+
+    self->options = new(nothrow) RE2::Options(options);
+    self->re2_set_obj = new(nothrow) RE2::Set(options, (RE2::Anchor)anchoring);
+
+    if (self->options == NULL || self->re2_set_obj == NULL) {
+      PyErr_NoMemory();
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+static PyObject*
+regexp_set_add(RegexpSetObject2* self, PyObject* pattern)
+{
+  if (self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add() on an already compiled Set");
+    return NULL;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add() while the Set is busy in another thread");
+    return NULL;
+  }
+
+  Py_ssize_t len_pattern;
+#if PY_MAJOR_VERSION >= 3
+  const char* raw_pattern = PyUnicode_AsUTF8AndSize(pattern, &len_pattern);
+  if (!raw_pattern) {
+    return NULL;
+  }
+#else
+  const char* raw_pattern = PyString_AsString(pattern);
+  if (!raw_pattern) {
+    return NULL;
+  }
+  len_pattern = PyString_GET_SIZE(pattern);
+#endif
+  bool prefix = _multiline_prefix(self->flags, *self->options);
+  std::string effective;
+  if (prefix) {
+    effective = MULTILINE_PREFIX;
+  }
+  effective.append(raw_pattern, len_pattern);
+  std::string add_error;
+  int seq = self->re2_set_obj->Add(effective, &add_error);
+
+  if (seq < 0) {
+    add_error = _pattern_error(effective, prefix, *self->options, add_error);
+    PyErr_SetString(PyExc_ValueError, add_error.c_str());
+    return NULL;
+  }
+
+  self->size = seq + 1;
+  return PyLong_FromLong(seq);
+}
+
+static PyObject*
+regexp_set_add_many(RegexpSetObject2* self, PyObject* patterns)
+{
+  if (self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add_many() on an already compiled Set");
+    return NULL;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add_many() while the Set is busy in another thread");
+    return NULL;
+  }
+
+  PyObject* seq = PySequence_Fast(patterns, "expected a sequence of patterns");
+  if (seq == NULL) {
+    return NULL;
+  }
+  Py_ssize_t n_patterns = PySequence_Fast_GET_SIZE(seq);
+  bool prefix = _multiline_prefix(self->flags, *self->options);
+  std::vector<std::string> effective(n_patterns);
+  for (Py_ssize_t i = 0; i < n_patterns; i++) {
+    if (!_effective_pattern(PySequence_Fast_GET_ITEM(seq, i), prefix, &effective[i])) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+  Py_DECREF(seq);
+
+  // RE2::Set::Add isn't thread-safe, so the patterns are parsed one after
+  // the other, but at least other threads can run meanwhile.
+  std::vector<int> indexes(n_patterns);
+  std::vector<std::string> errors(n_patterns);
+  self->busy = true;
+  Py_BEGIN_ALLOW_THREADS
+  for (Py_ssize_t i = 0; i < n_patterns; i++) {
+    indexes[i] = self->re2_set_obj->Add(effective[i], &errors[i]);
+  }
+  Py_END_ALLOW_THREADS
+  self->busy = false;
+
+  PyObject* result = PyList_New(n_patterns);
+  if (result == NULL) {
+    return NULL;
+  }
+  for (Py_ssize_t i = 0; i < n_patterns; i++) {
+    PyObject* item;
+    if (indexes[i] >= 0) {
+      self->size = indexes[i] + 1;
+      item = PyLong_FromLong(indexes[i]);
+    } else {
+      errors[i] = _pattern_error(effective[i], prefix, *self->options, errors[i]);
+      item = PyObject_CallFunction(PyExc_ValueError, (char*)"s#",
+          errors[i].data(), (Py_ssize_t)errors[i].size());
+    }
+    if (item == NULL) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, item);
+  }
+  return result;
+}
+
+static PyObject*
+regexp_set_compile(RegexpSetObject2* self)
+{
+  if (self->compiled) {
+    Py_RETURN_NONE;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't compile() while the Set is busy in another thread");
+    return NULL;
+  }
+
+  // Compiling a big set takes a while, so let other threads run.
+  bool compiled;
+  self->busy = true;
+  Py_BEGIN_ALLOW_THREADS
+  compiled = self->re2_set_obj->Compile();
+  Py_END_ALLOW_THREADS
+  self->busy = false;
+
+  if (!compiled) {
+    PyErr_SetString(PyExc_MemoryError, "Ran out of memory during regexp compile");
+    return NULL;
+  }
+
+  self->compiled = true;
+  Py_RETURN_NONE;
+}
+
+/**
+ * Match text against self, collecting the indexes of the matching patterns
+ * in v, or stopping at the first match if v is NULL.  fname names the
+ * method for errors.  Return -1 on failure (exception), else whether
+ * anything matched.
+ */
+static int
+_set_match(RegexpSetObject2* self, PyObject* text, const char* fname, std::vector<int>* v)
+{
+  if (!self->compiled) {
+    PyErr_Format(PyExc_RuntimeError, "Can't %s() on an uncompiled Set", fname);
+    return -1;
+  }
+
+  Subject subject;
+  if (!_subject_get(text, &subject, "expected str or a bytes-like object", false)) {
+    return -1;
+  }
+  const char* raw_text = subject.data;
+  Py_ssize_t len_text = subject.size;
+
+  bool matched;
+  if (len_text >= GIL_RELEASE_THRESHOLD) {
+    Py_BEGIN_ALLOW_THREADS
+    matched = self->re2_set_obj->Match(StringPiece(raw_text, len_text), v);
+    Py_END_ALLOW_THREADS
+  } else {
+    matched = self->re2_set_obj->Match(StringPiece(raw_text, len_text), v);
+  }
+  _subject_release(&subject);
+  return matched;
+}
+
+/**
+ * Parse the (text[, as_bitmap]) arguments of Set.match.  Return false on
+ * failure (exception).
+ */
+static bool
+_parse_set_match_args(SEARCH_PARAMS, PyObject** text, bool* as_bitmap)
+{
+  static const char* kwlist[] = {
+    "text",
+    "as_bitmap",
+    NULL};
+  PyObject* values[2] = {NULL, NULL};
+
+#ifdef HAVE_FASTCALL
+  if (nargs > 2) {
+    PyErr_Format(PyExc_TypeError,
+        "match() takes at most 2 arguments (%zd given)", nargs);
+    return false;
+  }
+  for (Py_ssize_t i = 0; i < nargs; i++) {
+    values[i] = args[i];
+  }
+  if (kwnames != NULL) {
+    Py_ssize_t nkw = PyTuple_GET_SIZE(kwnames);
+    for (Py_ssize_t k = 0; k < nkw; k++) {
+      PyObject* key = PyTuple_GET_ITEM(kwnames, k);
+      Py_ssize_t i = 0;
+      while (i < 2 && PyUnicode_CompareWithASCIIString(key, kwlist[i]) != 0) {
+        i++;
+      }
+      if (i == 2 || values[i] != NULL) {
+        PyErr_Format(PyExc_TypeError,
+            "match() got an unexpected or repeated keyword argument '%U'", key);
+        return false;
+      }
+      values[i] = args[nargs + k];
+    }
+  }
+  if (values[0] == NULL) {
+    PyErr_SetString(PyExc_TypeError, "match() missing required argument 'text' (pos 1)");
+    return false;
+  }
+#else
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:match", (char**)kwlist,
+        &values[0], &values[1])) {
+    return false;
+  }
+#endif
+
+  *text = values[0];
+  *as_bitmap = false;
+  if (values[1] != NULL) {
+    int truth = PyObject_IsTrue(values[1]);
+    if (truth < 0) {
+      return false;
+    }
+    *as_bitmap = truth != 0;
+  }
+  return true;
+}
+
+static PyObject*
+regexp_set_match(RegexpSetObject2* self, SEARCH_PARAMS)
+{
+  PyObject* text;
+  bool as_bitmap;
+  if (!_parse_set_match_args(SEARCH_ARGS, &text, &as_bitmap)) {
+    return NULL;
+  }
+
+  std::vector<int> idxes;
+  int matched = _set_match(self, text, "match", &idxes);
+  if (matched < 0) {
+    return NULL;
+  }
+  if (!matched) {
+    idxes.clear();
+  }
+
+  if (as_bitmap) {
+    PyObject* bitmap = PyBytes_FromStringAndSize(NULL, (self->size + 7) / 8);
+    if (bitmap == NULL) {
+      return NULL;
+    }
+    unsigned char* bits = (unsigned char*)PyBytes_AS_STRING(bitmap);
+    memset(bits, 0, PyBytes_GET_SIZE(bitmap));
+    for (size_t i = 0; i < idxes.size(); i++) {
+      bits[idxes[i] >> 3] |= 1 << (idxes[i] & 7);
+    }
+    return bitmap;
+  }
+
+  PyObject* match_indexes = PyList_New(idxes.size());
+  if (match_indexes == NULL) {
+    return NULL;
+  }
+  for (std::vector<int>::size_type i = 0; i < idxes.size(); ++i) {
+    PyObject* index = PyLong_FromLong(idxes[i]);
+    if (index == NULL) {
+      Py_DECREF(match_indexes);
+      return NULL;
+    }
+    PyList_SET_ITEM(match_indexes, (Py_ssize_t)i, index);
+  }
+  return match_indexes;
+}
+
+static PyObject*
+regexp_set_test(RegexpSetObject2* self, PyObject* text)
+{
+  // Without a vector to fill, RE2::Set stops at the earliest match.
+  int matched = _set_match(self, text, "test", NULL);
+  if (matched < 0) {
+    return NULL;
+  }
+  return PyBool_FromLong(matched);
+}
+
+/**
+ * Return a new array holding a copy of values, with the given struct format.
+ */
+template <typename T>
+static PyObject*
+create_array(const std::vector<T>& values, char format)
+{
+  ArrayObject2* array = PyObject_New(ArrayObject2, &Array_Type2);
+  if (array == NULL) {
+    return NULL;
+  }
+  array->format[0] = format;
+  array->format[1] = '\0';
+  array->itemsize = sizeof(T);
+  array->length = values.size();
+  array->nbytes = values.size() * sizeof(T);
+  // Always allocate something, so buffers never have a NULL pointer.
+  array->data = PyMem_Malloc(values.size() * sizeof(T) + 1);
+  if (array->data == NULL) {
+    Py_DECREF(array);
+    return PyErr_NoMemory();
+  }
+  if (!values.empty()) {
+    memcpy(array->data, &values[0], values.size() * sizeof(T));
+  }
+  return (PyObject*)array;
+}
+
+static void
+array_dealloc(ArrayObject2* self)
+{
+  PyMem_Free(self->data);
+  PyObject_Del(self);
+}
+
+static Py_ssize_t
+array_length(ArrayObject2* self)
+{
+  return self->length;
+}
+
+static PyObject*
+array_item(ArrayObject2* self, Py_ssize_t i)
+{
+  if (i < 0 || i >= self->length) {
+    PyErr_SetString(PyExc_IndexError, "array index out of range");
+    return NULL;
+  }
+  if (self->format[0] == 'q') {
+    return PyLong_FromLongLong(((PY_LONG_LONG*)self->data)[i]);
+  }
+  if (self->format[0] == '?') {
+    return PyBool_FromLong(((bool*)self->data)[i]);
+  }
+  return PyLong_FromLong(((int*)self->data)[i]);
+}
+
+static int
+array_getbuffer(ArrayObject2* self, Py_buffer* view, int flags)
+{
+  if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "RE2 arrays are read-only");
+    view->obj = NULL;
+    return -1;
+  }
+  // A NULL format means unsigned bytes, so without PyBUF_FORMAT the view
+  // has to describe the data as bytes.
+  static Py_ssize_t byte_stride = 1;
+  bool typed = (flags & PyBUF_FORMAT) != 0;
+  Py_INCREF(self);
+  view->obj = (PyObject*)self;
+  view->buf = self->data;
+  view->len = self->nbytes;
+  view->readonly = 1;
+  view->itemsize = typed ? self->itemsize : 1;
+  view->format = typed ? self->format : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? (typed ? &self->length : &self->nbytes) : NULL;
+  view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ?
+    (typed ? &self->itemsize : &byte_stride) : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+/**
+ * Resolve a num_threads argument for a batch of n_items: 0 means one
+ * thread per CPU, and there is no point in more threads than items.
+ * Return 0 on failure (exception).
+ */
+static int
+_batch_threads(int num_threads, Py_ssize_t n_items)
+{
+  if (num_threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "num_threads must not be negative");
+    return 0;
+  }
+  if (num_threads == 0) {
+    num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  }
+  return (int)std::max<Py_ssize_t>(1, std::min<Py_ssize_t>(num_threads, n_items));
+}
+
+/**
+ * Call work(begin, end) over consecutive chunks of [0, n_items) on
+ * num_threads threads, the calling one included.  Threads claim chunks
+ * from a shared counter, so ones that get ahead take on more of them.
+ * work must write its results by index, so their order doesn't depend on
+ * scheduling.  Called without the GIL.
+ */
+template <typename F>
+static void
+_parallel_for(Py_ssize_t n_items, int num_threads, const F& work)
+{
+  if (num_threads <= 1) {
+    work(0, n_items);
+    return;
+  }
+  // Several chunks per thread even out uneven texts.
+  const Py_ssize_t chunk = std::max<Py_ssize_t>(1, n_items / ((Py_ssize_t)num_threads * 8));
+  std::atomic<Py_ssize_t> next(0);
+  auto run = [&]() {
+    for (;;) {
+      Py_ssize_t begin = next.fetch_add(chunk);
+      if (begin >= n_items) {
+        break;
+      }
+      work(begin, std::min(begin + chunk, n_items));
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    try {
+      threads.push_back(std::thread(run));
+    } catch (const std::system_error&) {
+      // Make do with the threads we have.
+      break;
+    }
+  }
+  run();
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+/**
+ * Return a new tuple of the texts passed to a batch method, or NULL on
+ * failure (exception).  A list can't be matched in place: another thread
+ * could change it, freeing texts, while the GIL is released.
+ */
+static PyObject*
+_batch_texts(PyObject* texts)
+{
+  PyObject* seq = PySequence_Fast(texts, "expected a sequence of texts");
+  if (seq == NULL) {
+    return NULL;
+  }
+  PyObject* tuple = PySequence_Tuple(seq);
+  Py_DECREF(seq);
+  return tuple;
+}
+
+/**
+ * Get at every text in seq (a tuple from _batch_texts) as a subject, so
+ * that a batch can be matched without the GIL; seq keeps the texts alive.
+ * Adds the subjects' sizes to *total.  Return false on failure
+ * (exception).
+ */
+static bool
+_batch_subjects_get(PyObject* seq, std::vector<Subject>* subjects, Py_ssize_t* total)
+{
+  Py_ssize_t n_texts = PyTuple_GET_SIZE(seq);
+  subjects->resize(n_texts);
+  for (Py_ssize_t i = 0; i < n_texts; i++) {
+    if (!_subject_get(PyTuple_GET_ITEM(seq, i), &(*subjects)[i],
+          "expected str or a bytes-like object", false)) {
+      while (--i >= 0) {
+        _subject_release(&(*subjects)[i]);
+      }
+      return false;
+    }
+    *total += (*subjects)[i].size;
+  }
+  return true;
+}
+
+static void
+_batch_subjects_release(std::vector<Subject>* subjects)
+{
+  for (size_t i = 0; i < subjects->size(); i++) {
+    _subject_release(&(*subjects)[i]);
+  }
+}
+
+/**
+ * Parse the (texts[, num_threads]) arguments of the batch methods into a
+ * tuple of the texts and their subjects.  Return NULL on failure
+ * (exception).
+ */
+static PyObject*
+_parse_batch_args(PyObject* args, PyObject* kwds, const char* format,
+    std::vector<Subject>* subjects, int* num_threads, bool* release)
+{
+  static const char* kwlist[] = {
+    "texts",
+    "num_threads",
+    NULL};
+
+  PyObject* texts;
+  *num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, format, (char**)kwlist,
+        &texts, num_threads)) {
+    return NULL;
+  }
+  PyObject* seq = _batch_texts(texts);
+  if (seq == NULL) {
+    return NULL;
+  }
+  *num_threads = _batch_threads(*num_threads, PyTuple_GET_SIZE(seq));
+  Py_ssize_t total = 0;
+  if (*num_threads == 0 || !_batch_subjects_get(seq, subjects, &total)) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  *release = *num_threads > 1 || total >= GIL_RELEASE_THRESHOLD;
+  return seq;
+}
+
+static PyObject*
+regexp_set_match_many(RegexpSetObject2* self, PyObject* args, PyObject* kwds)
+{
+  if (!self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't match_many() on an uncompiled Set");
+    return NULL;
+  }
+
+  std::vector<Subject> subjects;
+  int num_threads;
+  bool release;
+  PyObject* seq = _parse_batch_args(args, kwds, "O|i:match_many",
+      &subjects, &num_threads, &release);
+  if (seq == NULL) {
+    return NULL;
+  }
+  Py_ssize_t n_texts = subjects.size();
+
+  // Each text's indexes are collected separately and then concatenated in
+  // order, so the result doesn't depend on how the work was split up.
+  std::vector<std::vector<int> > results(n_texts);
+  const RE2::Set* set = self->re2_set_obj;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _parallel_for(n_texts, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    for (Py_ssize_t i = begin; i < end; i++) {
+      if (!set->Match(StringPiece(subjects[i].data, subjects[i].size), &results[i])) {
+        results[i].clear();
+      }
+    }
+  });
+  std::vector<PY_LONG_LONG> offsets(n_texts + 1);
+  std::vector<int> indexes;
+  offsets[0] = 0;
+  for (Py_ssize_t i = 0; i < n_texts; i++) {
+    indexes.insert(indexes.end(), results[i].begin(), results[i].end());
+    offsets[i + 1] = indexes.size();
+  }
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+
+  _batch_subjects_release(&subjects);
+  Py_DECREF(seq);
+
+  PyObject* offsets_array = create_array(offsets, 'q');
+  if (offsets_array == NULL) {
+    return NULL;
+  }
+  PyObject* indexes_array = create_array(indexes, 'i');
+  if (indexes_array == NULL) {
+    Py_DECREF(offsets_array);
+    return NULL;
+  }
+  return Py_BuildValue("NN", offsets_array, indexes_array);
+}
+
+static PyObject*
+regexp_test_many(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  std::vector<Subject> subjects;
+  int num_threads;
+  bool release;
+  PyObject* seq = _parse_batch_args(args, kwds, "O|i:test_many",
+      &subjects, &num_threads, &release);
+  if (seq == NULL) {
+    return NULL;
+  }
+  Py_ssize_t n_texts = subjects.size();
+
+  // Not std::vector<bool>, which is packed.
+  std::vector<char> results(n_texts);
+  const RE2* re = self->re2_obj;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _parallel_for(n_texts, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    for (Py_ssize_t i = begin; i < end; i++) {
+      results[i] = re->Match(StringPiece(subjects[i].data, subjects[i].size),
+          0, subjects[i].size, RE2::UNANCHORED, NULL, 0);
+    }
+  });
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+
+  _batch_subjects_release(&subjects);
+  Py_DECREF(seq);
+  return create_array(results, '?');
+}
+
+/**
+ * Count the code points in a run of UTF-8.
+ */
+static Py_ssize_t
+_utf8_length(const char* data, Py_ssize_t size)
+{
+  Py_ssize_t n = 0;
+  for (Py_ssize_t i = 0; i < size; i++) {
+    n += (data[i] & 0xC0) != 0x80;
+  }
+  return n;
+}
+
+/**
+ * Build the dict of columns for extract_many from the spans of each group
+ * in each text of seq (a tuple from _batch_texts),
+ * spans[(i * n_groups + g) * 2], laid out row by row.
+ */
+static PyObject*
+_extract_columns(RegexpObject2* self, PyObject* seq, const std::vector<Subject>& subjects,
+    const std::vector<Py_ssize_t>& spans, bool as_spans)
+{
+  Py_ssize_t n_texts = subjects.size();
+  Py_ssize_t n_groups = self->groups;
+  std::vector<PyObject*> names(n_groups + 1);
+  Py_ssize_t pos = 0;
+  PyObject* name;
+  PyObject* index;
+  while (PyDict_Next(self->groupindex, &pos, &name, &index)) {
+    names[PyLong_AsLong(index)] = name;
+  }
+  PyObject* columns = PyDict_New();
+  if (columns == NULL) {
+    return NULL;
+  }
+  for (Py_ssize_t g = 1; g <= n_groups; g++) {
+    PyObject* key = names[g];
+    if (key != NULL) {
+      Py_INCREF(key);
+    } else {
+      key = PyLong_FromSsize_t(g);
+    }
+    PyObject* column = NULL;
+    if (key != NULL && as_spans) {
+      std::vector<PY_LONG_LONG> starts(n_texts), ends(n_texts);
+      for (Py_ssize_t i = 0; i < n_texts; i++) {
+        starts[i] = spans[(i * n_groups + g - 1) * 2];
+        ends[i] = spans[(i * n_groups + g - 1) * 2 + 1];
+      }
+      PyObject* starts_array = create_array(starts, 'q');
+      PyObject* ends_array = starts_array != NULL ? create_array(ends, 'q') : NULL;
+      if (ends_array != NULL) {
+        column = Py_BuildValue("NN", starts_array, ends_array);
+      } else {
+        Py_XDECREF(starts_array);
+      }
+    } else if (key != NULL) {
+      column = PyList_New(n_texts);
+      for (Py_ssize_t i = 0; column != NULL && i < n_texts; i++) {
+        Py_ssize_t start = spans[(i * n_groups + g - 1) * 2];
+        Py_ssize_t end = spans[(i * n_groups + g - 1) * 2 + 1];
+        const Subject& subject = subjects[i];
+        PyObject* value;
+        if (start < 0) {
+          Py_INCREF(Py_None);
+          value = Py_None;
+        } else if (PyUnicode_Check(PyTuple_GET_ITEM(seq, i))) {
+          value = PyUnicode_DecodeUTF8(subject.data + start, end - start, NULL);
+        } else {
+          value = PyBytes_FromStringAndSize(subject.data + start, end - start);
+        }
+        if (value == NULL) {
+          Py_CLEAR(column);
+          break;
+        }
+        PyList_SET_ITEM(column, i, value);
+      }
+    }
+    if (column == NULL || PyDict_SetItem(columns, key, column) < 0) {
+      Py_XDECREF(key);
+      Py_XDECREF(column);
+      Py_DECREF(columns);
+      return NULL;
+    }
+    Py_DECREF(key);
+    Py_DECREF(column);
+  }
+  return columns;
+}
+
+static PyObject*
+regexp_extract_many(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {
+    "texts",
+    "spans",
+    "num_threads",
+    NULL};
+
+  PyObject* texts;
+  PyObject* spans_obj = NULL;
+  int num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oi:extract_many", (char**)kwlist,
+        &texts, &spans_obj, &num_threads)) {
+    return NULL;
+  }
+  int as_spans = spans_obj != NULL ? PyObject_IsTrue(spans_obj) : 0;
+  if (as_spans < 0) {
+    return NULL;
+  }
+  PyObject* seq = _batch_texts(texts);
+  if (seq == NULL) {
+    return NULL;
+  }
+  std::vector<Subject> subjects;
+  Py_ssize_t total = 0;
+  num_threads = _batch_threads(num_threads, PyTuple_GET_SIZE(seq));
+  if (num_threads == 0 || !_batch_subjects_get(seq, &subjects, &total)) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  Py_ssize_t n_texts = subjects.size();
+  Py_ssize_t n_groups = self->groups;
+
+  // The spans of every group of every text, in bytes until converted to
+  // code points for non-ASCII str texts when spans are wanted.
+  std::vector<Py_ssize_t> spans(n_texts * n_groups * 2, -1);
+  const RE2* re = self->re2_obj;
+  bool release = num_threads > 1 || total >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _parallel_for(n_texts, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    std::vector<StringPiece> groups(n_groups + 1);
+    for (Py_ssize_t i = begin; i < end; i++) {
+      const Subject& subject = subjects[i];
+      if (!re->Match(StringPiece(subject.data, subject.size), 0, subject.size,
+            RE2::UNANCHORED, &groups[0], n_groups + 1)) {
+        continue;
+      }
+      Py_ssize_t* row = &spans[i * n_groups * 2];
+      for (Py_ssize_t g = 1; g <= n_groups; g++) {
+        if (groups[g].data() == NULL) {
+          continue;
+        }
+        Py_ssize_t start = groups[g].data() - subject.data;
+        Py_ssize_t stop = start + groups[g].size();
+        if (as_spans && subject.utf8_str) {
+          Py_ssize_t cp = _utf8_length(subject.data, start);
+          start = cp;
+          stop = cp + _utf8_length(groups[g].data(), groups[g].size());
+        }
+        row[(g - 1) * 2] = start;
+        row[(g - 1) * 2 + 1] = stop;
+      }
+    }
+  });
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+
+  PyObject* columns = _extract_columns(self, seq, subjects, spans, as_spans);
+  _batch_subjects_release(&subjects);
+  Py_DECREF(seq);
+  return columns;
+}
+
+// The buffers of an Arrow-style string column, as passed to test_arrow.
+typedef struct _StringColumn {
+  Py_buffer offsets;
+  // 4 or 8.
+  int offset_size;
+  Subject data;
+  bool has_data;
+  Subject validity;
+  bool has_validity;
+  Py_ssize_t offset;
+  Py_ssize_t length;
+} StringColumn;
+
+static void
+_string_column_release(StringColumn* column)
+{
+  if (column->offsets.obj != NULL) {
+    PyBuffer_Release(&column->offsets);
+  }
+  if (column->has_data) {
+    _subject_release(&column->data);
+  }
+  if (column->has_validity) {
+    _subject_release(&column->validity);
+  }
+}
+
+/**
+ * Parse the arguments of test_arrow into a column.  Return false on failure
+ * (exception), having released whatever was acquired.
+ */
+static bool
+_parse_arrow_args(PyObject* args, PyObject* kwds, const char* format,
+    StringColumn* column, bool* as_bitmap, int* num_threads)
+{
+  static const char* kwlist[] = {
+    "offsets",
+    "data",
+    "length",
+    "validity",
+    "offset",
+    "large",
+    "as_bitmap",
+    "num_threads",
+    NULL};
+
+  PyObject* offsets;
+  PyObject* data;
+  PyObject* length = Py_None;
+  PyObject* validity = Py_None;
+  PyObject* large = NULL;
+  PyObject* bitmap = NULL;
+  column->offsets.obj = NULL;
+  column->has_data = false;
+  column->has_validity = false;
+  column->offset = 0;
+  *num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, format, (char**)kwlist,
+        &offsets, &data, &length, &validity, &column->offset, &large, &bitmap,
+        num_threads)) {
+    return false;
+  }
+  int is_large = large != NULL ? PyObject_IsTrue(large) : 0;
+  int truth = bitmap != NULL ? PyObject_IsTrue(bitmap) : 0;
+  if (is_large < 0 || truth < 0) {
+    return false;
+  }
+  *as_bitmap = truth != 0;
+
+  if (PyObject_GetBuffer(offsets, &column->offsets, PyBUF_FORMAT) < 0) {
+    column->offsets.obj = NULL;
+    return false;
+  }
+  Py_ssize_t itemsize = column->offsets.itemsize;
+  if (itemsize == 1) {
+    column->offset_size = is_large ? 8 : 4;
+  } else if (itemsize == 4 || itemsize == 8) {
+    column->offset_size = (int)itemsize;
+  } else {
+    PyErr_SetString(PyExc_TypeError, "offsets must hold 32-bit or 64-bit integers");
+    _string_column_release(column);
+    return false;
+  }
+  Py_ssize_t n_offsets = column->offsets.len / column->offset_size;
+
+  // Offsets are byte offsets, which wouldn't mean much into a str.
+  if (PyUnicode_Check(data) ||
+      !_subject_get(data, &column->data, "data must be a bytes-like object", false)) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_TypeError, "data must be a bytes-like object");
+    }
+    _string_column_release(column);
+    return false;
+  }
+  column->has_data = true;
+
+  if (column->offset < 0) {
+    PyErr_SetString(PyExc_ValueError, "offset must not be negative");
+    _string_column_release(column);
+    return false;
+  }
+  if (length == Py_None) {
+    column->length = std::max<Py_ssize_t>(0, n_offsets - column->offset - 1);
+  } else {
+    column->length = PyNumber_AsSsize_t(length, PyExc_OverflowError);
+    if (column->length == -1 && PyErr_Occurred()) {
+      _string_column_release(column);
+      return false;
+    }
+  }
+  if (column->length < 0 || column->length > n_offsets - column->offset - 1) {
+    PyErr_SetString(PyExc_ValueError, "offset and length out of range of offsets");
+    _string_column_release(column);
+    return false;
+  }
+
+  if (validity != Py_None) {
+    if (PyUnicode_Check(validity) ||
+        !_subject_get(validity, &column->validity, "validity must be a bytes-like object", false)) {
+      if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "validity must be a bytes-like object");
+      }
+      _string_column_release(column);
+      return false;
+    }
+    column->has_validity = true;
+    if (column->validity.size < (column->offset + column->length + 7) / 8) {
+      PyErr_SetString(PyExc_ValueError, "validity bitmap too short");
+      _string_column_release(column);
+      return false;
+    }
+  }
+
+  *num_threads = _batch_threads(*num_threads, column->length);
+  if (*num_threads == 0) {
+    _string_column_release(column);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Get at the i-th offset of a column.  Offsets buffers are often untyped,
+ * so they aren't assumed to be aligned.
+ */
+static inline PY_LONG_LONG
+_string_column_offset(const StringColumn* column, Py_ssize_t i)
+{
+  const char* p = (const char*)column->offsets.buf + i * column->offset_size;
+  if (column->offset_size == 8) {
+    int64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  int32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/**
+ * Call test(element) on each valid element of column, on num_threads
+ * threads, and return the results as a bool array or bitmap.  Nulls test
+ * false.  Releases the column.
+ */
+template <typename F>
+static PyObject*
+_test_arrow(StringColumn* column, bool as_bitmap, int num_threads, const F& test)
+{
+  Py_ssize_t length = column->length;
+  std::vector<char> results(length);
+  std::atomic<bool> bad_offsets(false);
+  bool release = num_threads > 1 || column->data.size >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _parallel_for(length, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    const unsigned char* valid = (const unsigned char*)column->validity.data;
+    for (Py_ssize_t i = begin; i < end; i++) {
+      Py_ssize_t j = column->offset + i;
+      if (column->has_validity && !(valid[j >> 3] & (1 << (j & 7)))) {
+        results[i] = 0;
+        continue;
+      }
+      PY_LONG_LONG start = _string_column_offset(column, j);
+      PY_LONG_LONG stop = _string_column_offset(column, j + 1);
+      if (start < 0 || stop < start || stop > column->data.size) {
+        bad_offsets = true;
+        results[i] = 0;
+        continue;
+      }
+      results[i] = test(StringPiece(column->data.data + start, stop - start));
+    }
+  });
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+  _string_column_release(column);
+
+  if (bad_offsets) {
+    PyErr_SetString(PyExc_ValueError, "offsets out of range of data");
+    return NULL;
+  }
+  if (!as_bitmap) {
+    return create_array(results, '?');
+  }
+  PyObject* bitmap = PyBytes_FromStringAndSize(NULL, (length + 7) / 8);
+  if (bitmap == NULL) {
+    return NULL;
+  }
+  unsigned char* bits = (unsigned char*)PyBytes_AS_STRING(bitmap);
+  memset(bits, 0, PyBytes_GET_SIZE(bitmap));
+  for (Py_ssize_t i = 0; i < length; i++) {
+    bits[i >> 3] |= results[i] << (i & 7);
+  }
+  return bitmap;
+}
+
+static PyObject*
+regexp_test_arrow(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  StringColumn column;
+  bool as_bitmap;
+  int num_threads;
+  if (!_parse_arrow_args(args, kwds, "OO|OOnOOi:test_arrow", &column, &as_bitmap, &num_threads)) {
+    return NULL;
+  }
+  const RE2* re = self->re2_obj;
+  return _test_arrow(&column, as_bitmap, num_threads, [&](const StringPiece& text) {
+    return re->Match(text, 0, text.size(), RE2::UNANCHORED, NULL, 0);
+  });
+}
+
+static PyObject*
+regexp_set_test_arrow(RegexpSetObject2* self, PyObject* args, PyObject* kwds)
+{
+  if (!self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't test_arrow() on an uncompiled Set");
+    return NULL;
+  }
+  StringColumn column;
+  bool as_bitmap;
+  int num_threads;
+  if (!_parse_arrow_args(args, kwds, "OO|OOnOOi:test_arrow", &column, &as_bitmap, &num_threads)) {
+    return NULL;
+  }
+  const RE2::Set* set = self->re2_set_obj;
+  return _test_arrow(&column, as_bitmap, num_threads, [&](const StringPiece& text) {
+    return set->Match(text, NULL);
+  });
+}
+
+// A run of whole lines of a grep_lines buffer, and the lines in it that
+// matched, numbered from the start of the run.
+typedef struct _GrepBlock {
+  Py_ssize_t begin;
+  Py_ssize_t end;
+  Py_ssize_t n_lines;
+  std::vector<PY_LONG_LONG> lines;
+  std::vector<PY_LONG_LONG> starts;
+  std::vector<PY_LONG_LONG> ends;
+  // For sets, the patterns matching each matched line, in CSR form.
+  std::vector<PY_LONG_LONG> counts;
+  std::vector<int> indexes;
+  std::vector<int> scratch;
+} GrepBlock;
+
+/**
+ * Split data into lines with memchr and call match_line(line, block) on
+ * each, on num_threads threads.  The buffer is cut into blocks of whole
+ * lines, which are numbered and concatenated in order afterwards.
+ * Called without the GIL.
+ */
+template <typename F>
+static void
+_grep_lines(const char* data, Py_ssize_t size, int num_threads, bool spans,
+    std::vector<GrepBlock>* blocks, const F& match_line)
+{
+  Py_ssize_t n_blocks = num_threads > 1 ? (Py_ssize_t)num_threads * 8 : 1;
+  blocks->resize(n_blocks);
+  Py_ssize_t begin = 0;
+  for (Py_ssize_t i = 0; i < n_blocks; i++) {
+    Py_ssize_t end = size;
+    Py_ssize_t split = std::max(begin, size / n_blocks * (i + 1));
+    if (i + 1 < n_blocks && split < size) {
+      const char* nl = (const char*)memchr(data + split, '\n', size - split);
+      end = nl != NULL ? nl - data + 1 : size;
+    }
+    (*blocks)[i].begin = begin;
+    (*blocks)[i].end = end;
+    (*blocks)[i].n_lines = 0;
+    begin = end;
+  }
+
+  _parallel_for(n_blocks, num_threads, [&](Py_ssize_t first, Py_ssize_t last) {
+    for (Py_ssize_t i = first; i < last; i++) {
+      GrepBlock* block = &(*blocks)[i];
+      Py_ssize_t pos = block->begin;
+      while (pos < block->end) {
+        const char* nl = (const char*)memchr(data + pos, '\n', block->end - pos);
+        Py_ssize_t line_end = nl != NULL ? nl - data : block->end;
+        if (match_line(StringPiece(data + pos, line_end - pos), block)) {
+          block->lines.push_back(block->n_lines);
+          if (spans) {
+            block->starts.push_back(pos);
+            block->ends.push_back(line_end);
+          }
+        }
+        block->n_lines++;
+        pos = line_end + 1;
+      }
+    }
+  });
+}
+
+/**
+ * Concatenate the results of _grep_lines into arrays: lines, then starts
+ * and ends if spans, then offsets and indexes if sets.
+ */
+static PyObject*
+_grep_result(std::vector<GrepBlock>* blocks, bool spans, bool sets)
+{
+  std::vector<PY_LONG_LONG> lines, starts, ends, offsets(1, 0);
+  std::vector<int> indexes;
+  Py_ssize_t first_line = 0;
+  for (size_t i = 0; i < blocks->size(); i++) {
+    GrepBlock* block = &(*blocks)[i];
+    for (size_t j = 0; j < block->lines.size(); j++) {
+      lines.push_back(first_line + block->lines[j]);
+    }
+    first_line += block->n_lines;
+    starts.insert(starts.end(), block->starts.begin(), block->starts.end());
+    ends.insert(ends.end(), block->ends.begin(), block->ends.end());
+    for (size_t j = 0; j < block->counts.size(); j++) {
+      offsets.push_back(offsets.back() + block->counts[j]);
+    }
+    indexes.insert(indexes.end(), block->indexes.begin(), block->indexes.end());
+  }
+
+  PyObject* arrays[5] = {NULL, NULL, NULL, NULL, NULL};
+  Py_ssize_t n = 0;
+  arrays[n++] = create_array(lines, 'q');
+  if (spans) {
+    arrays[n++] = create_array(starts, 'q');
+    arrays[n++] = create_array(ends, 'q');
+  }
+  if (sets) {
+    arrays[n++] = create_array(offsets, 'q');
+    arrays[n++] = create_array(indexes, 'i');
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    if (arrays[i] == NULL) {
+      for (Py_ssize_t j = 0; j < n; j++) {
+        Py_XDECREF(arrays[j]);
+      }
+      return NULL;
+    }
+  }
+  if (n == 1) {
+    return arrays[0];
+  }
+  PyObject* result = PyTuple_New(n);
+  if (result == NULL) {
+    for (Py_ssize_t j = 0; j < n; j++) {
+      Py_DECREF(arrays[j]);
+    }
+    return NULL;
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyTuple_SET_ITEM(result, i, arrays[i]);
+  }
+  return result;
+}
+
+/**
+ * Parse the (buffer[, spans, num_threads]) arguments of grep_lines.
+ * Return false on failure (exception).
+ */
+static bool
+_parse_grep_args(PyObject* args, PyObject* kwds, const char* format,
+    Subject* subject, bool* spans, int* num_threads)
+{
+  static const char* kwlist[] = {
+    "buffer",
+    "spans",
+    "num_threads",
+    NULL};
+
+  PyObject* buffer;
+  PyObject* spans_obj = NULL;
+  *num_threads = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, format, (char**)kwlist,
+        &buffer, &spans_obj, num_threads)) {
+    return false;
+  }
+  int truth = spans_obj != NULL ? PyObject_IsTrue(spans_obj) : 0;
+  if (truth < 0) {
+    return false;
+  }
+  *spans = truth != 0;
+  // Spans are byte offsets, which wouldn't mean much for a str.
+  if (PyUnicode_Check(buffer)) {
+    PyErr_SetString(PyExc_TypeError, "grep_lines() expected a bytes-like object");
+    return false;
+  }
+  if (!_subject_get(buffer, subject, "grep_lines() expected a bytes-like object", false)) {
+    return false;
+  }
+  *num_threads = _batch_threads(*num_threads, subject->size);
+  if (*num_threads == 0) {
+    _subject_release(subject);
+    return false;
+  }
+  return true;
+}
+
+static PyObject*
+regexp_grep_lines(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  Subject subject;
+  bool spans;
+  int num_threads;
+  if (!_parse_grep_args(args, kwds, "O|Oi:grep_lines", &subject, &spans, &num_threads)) {
+    return NULL;
+  }
+
+  std::vector<GrepBlock> blocks;
+  const RE2* re = self->re2_obj;
+  bool release = num_threads > 1 || subject.size >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _grep_lines(subject.data, subject.size, num_threads, spans, &blocks,
+      [&](const StringPiece& line, GrepBlock*) {
+        return re->Match(line, 0, line.size(), RE2::UNANCHORED, NULL, 0);
+      });
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+  _subject_release(&subject);
+  return _grep_result(&blocks, spans, false);
+}
+
+static PyObject*
+regexp_set_grep_lines(RegexpSetObject2* self, PyObject* args, PyObject* kwds)
+{
+  if (!self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't grep_lines() on an uncompiled Set");
+    return NULL;
+  }
+  Subject subject;
+  bool spans;
+  int num_threads;
+  if (!_parse_grep_args(args, kwds, "O|Oi:grep_lines", &subject, &spans, &num_threads)) {
+    return NULL;
+  }
+
+  std::vector<GrepBlock> blocks;
+  const RE2::Set* set = self->re2_set_obj;
+  bool release = num_threads > 1 || subject.size >= GIL_RELEASE_THRESHOLD;
+  PyThreadState* thread_state = release ? PyEval_SaveThread() : NULL;
+  _grep_lines(subject.data, subject.size, num_threads, spans, &blocks,
+      [&](const StringPiece& line, GrepBlock* block) {
+        if (!set->Match(line, &block->scratch)) {
+          return false;
         }
-        PyTuple_SET_ITEM(ret, i, group);
+        block->counts.push_back(block->scratch.size());
+        block->indexes.insert(block->indexes.end(), block->scratch.begin(), block->scratch.end());
+        return true;
+      });
+  if (release) {
+    PyEval_RestoreThread(thread_state);
+  }
+  _subject_release(&subject);
+  return _grep_result(&blocks, spans, true);
+}
+
+
+// Default window sizes for streams.
+#define STREAM_MAX_MATCH_LEN 65536
+#define STREAM_CHUNK_SIZE 65536
+
+/**
+ * Parse the (source[, max_match_len, chunk_size]) arguments of the stream
+ * methods and start reading source.  Return false on failure (exception).
+ */
+static bool
+_stream_reader_init(PyObject* args, PyObject* kwds, const char* format,
+    StreamReader* reader, Py_ssize_t* max_match_len)
+{
+  static const char* kwlist[] = {
+    "source",
+    "max_match_len",
+    "chunk_size",
+    NULL};
+
+  PyObject* source;
+  *max_match_len = STREAM_MAX_MATCH_LEN;
+  reader->chunk_size = STREAM_CHUNK_SIZE;
+  reader->readinto = NULL;
+  reader->iter = NULL;
+  reader->buf = NULL;
+  reader->len = 0;
+  reader->base = 0;
+  reader->eof = false;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, format, (char**)kwlist,
+        &source, max_match_len, &reader->chunk_size)) {
+    return false;
+  }
+  if (*max_match_len < 1 || reader->chunk_size < 1) {
+    PyErr_SetString(PyExc_ValueError, "max_match_len and chunk_size must be positive");
+    return false;
+  }
+
+  reader->readinto = PyObject_GetAttrString(source, "readinto");
+  if (reader->readinto == NULL) {
+    PyErr_Clear();
+    reader->iter = PyObject_GetIter(source);
+    if (reader->iter == NULL) {
+      PyErr_SetString(PyExc_TypeError,
+          "expected an object with readinto() or an iterable of bytes-like objects");
+      return false;
+    }
+  }
+  reader->buf = new(nothrow) std::vector<char>();
+  if (reader->buf == NULL) {
+    PyErr_NoMemory();
+    return false;
+  }
+  return true;
+}
+
+static void
+_stream_reader_release(StreamReader* reader)
+{
+  Py_CLEAR(reader->readinto);
+  Py_CLEAR(reader->iter);
+  delete reader->buf;
+  reader->buf = NULL;
+}
+
+/**
+ * Return the start of the window.
+ */
+static const char*
+_stream_reader_data(const StreamReader* reader)
+{
+  return reader->len > 0 ? &(*reader->buf)[0] : "";
+}
+
+/**
+ * Drop the first n bytes of the window.
+ */
+static void
+_stream_reader_discard(StreamReader* reader, Py_ssize_t n)
+{
+  if (n > 0) {
+    char* data = &(*reader->buf)[0];
+    memmove(data, data + n, reader->len - n);
+    reader->len -= n;
+    reader->base += n;
+  }
+}
+
+/**
+ * Append the next chunk of the stream to the window, or set eof.  Return
+ * false on failure (exception).
+ */
+static bool
+_stream_reader_fill(StreamReader* reader)
+{
+  std::vector<char>* buf = reader->buf;
+  if (reader->readinto != NULL) {
+    // Read straight into the window, which is only ever grown, so after
+    // the first few reads there are no allocations.
+    if ((Py_ssize_t)buf->size() < reader->len + reader->chunk_size) {
+      buf->resize(reader->len + reader->chunk_size);
+    }
+#if PY_MAJOR_VERSION >= 3
+    PyObject* view = PyMemoryView_FromMemory(&(*buf)[reader->len], reader->chunk_size, PyBUF_WRITE);
+#else
+    PyObject* view = PyBuffer_FromReadWriteMemory(&(*buf)[reader->len], reader->chunk_size);
+#endif
+    if (view == NULL) {
+      return false;
+    }
+    PyObject* result = PyObject_CallFunctionObjArgs(reader->readinto, view, NULL);
+#if PY_MAJOR_VERSION >= 3
+    // Don't let the source hang on to a view of the window.
+    PyObject* released = PyObject_CallMethod(view, (char*)"release", NULL);
+    if (released == NULL) {
+      Py_XDECREF(result);
+      result = NULL;
+    }
+    Py_XDECREF(released);
+#endif
+    Py_DECREF(view);
+    if (result == NULL) {
+      return false;
+    }
+    if (result == Py_None) {
+      Py_DECREF(result);
+      PyErr_SetString(PyExc_ValueError, "non-blocking sources are not supported");
+      return false;
+    }
+    Py_ssize_t n = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+    Py_DECREF(result);
+    if (n == -1 && PyErr_Occurred()) {
+      return false;
+    }
+    if (n < 0 || n > reader->chunk_size) {
+      PyErr_SetString(PyExc_ValueError, "readinto() returned an invalid size");
+      return false;
+    }
+    reader->len += n;
+    reader->eof = n == 0;
+    return true;
+  }
+
+  PyObject* item = PyIter_Next(reader->iter);
+  if (item == NULL) {
+    reader->eof = !PyErr_Occurred();
+    return reader->eof;
+  }
+  Subject chunk;
+  bool ok = !PyUnicode_Check(item) &&
+    _subject_get(item, &chunk, "expected a bytes-like chunk", false);
+  if (!ok && !PyErr_Occurred()) {
+    PyErr_SetString(PyExc_TypeError, "expected a bytes-like chunk");
+  }
+  Py_DECREF(item);
+  if (!ok) {
+    return false;
+  }
+  if ((Py_ssize_t)buf->size() < reader->len + chunk.size) {
+    buf->resize(reader->len + chunk.size);
+  }
+  if (chunk.size > 0) {
+    memcpy(&(*buf)[reader->len], chunk.data, chunk.size);
+  }
+  reader->len += chunk.size;
+  _subject_release(&chunk);
+  return true;
+}
+
+static PyObject*
+regexp_scan_stream(RegexpObject2* self, PyObject* args, PyObject* kwds)
+{
+  StreamIteratorObject2* it = PyObject_New(StreamIteratorObject2, &StreamIterator_Type2);
+  if (it == NULL) {
+    return NULL;
+  }
+  Py_INCREF(self);
+  it->re = (PyObject*)self;
+  it->next = 0;
+  it->busy = false;
+  it->longest = _regexp_longest(self, self->re2_obj);
+  it->after_empty = false;
+  if (!_stream_reader_init(args, kwds, "O|nn:scan_stream", &it->reader, &it->max_match_len)) {
+    Py_DECREF(it);
+    return NULL;
+  }
+  return (PyObject*)it;
+}
+
+static void
+stream_iterator_dealloc(StreamIteratorObject2* self)
+{
+  _stream_reader_release(&self->reader);
+  Py_XDECREF(self->re);
+  PyObject_Del(self);
+}
+
+/**
+ * Match re against the window from next, releasing the GIL for large
+ * windows.
+ */
+static bool
+_stream_iterator_match(StreamIteratorObject2* self, const RE2* re, RE2::Anchor anchor,
+    StringPiece* match)
+{
+  Py_ssize_t len = self->reader.len;
+  StringPiece text(_stream_reader_data(&self->reader), len);
+  bool found;
+  if (len - self->next >= GIL_RELEASE_THRESHOLD) {
+    self->busy = true;
+    Py_BEGIN_ALLOW_THREADS
+    found = re->Match(text, self->next, len, anchor, match, 1);
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+  } else {
+    found = re->Match(text, self->next, len, anchor, match, 1);
+  }
+  return found;
+}
+
+/**
+ * Return the (start, end, bytes) tuple for match, which is in the window,
+ * and resume the scan after it.
+ */
+static PyObject*
+_stream_iterator_result(StreamIteratorObject2* self, const StringPiece& match)
+{
+  Py_ssize_t start = match.data() - _stream_reader_data(&self->reader);
+  Py_ssize_t end = start + match.size();
+  self->next = end;
+  self->after_empty = match.empty();
+  PyObject* matched = PyBytes_FromStringAndSize(match.data(), match.size());
+  if (matched == NULL) {
+    return NULL;
+  }
+  return Py_BuildValue("LLN", self->reader.base + start, self->reader.base + end, matched);
+}
+
+static PyObject*
+stream_iterator_next(StreamIteratorObject2* self)
+{
+  if (self->busy) {
+    PyErr_SetString(PyExc_ValueError, "stream iterator already executing");
+    return NULL;
+  }
+  const RE2* re = ((RegexpObject2*)self->re)->re2_obj;
+  StreamReader* reader = &self->reader;
+
+  for (;;) {
+    // The window holds one byte before next (if the stream has one) as
+    // context for ^ and \b.  A match counts once there are more than
+    // max_match_len bytes after its start, as no longer or earlier match
+    // could then depend on bytes yet to be read, and $ and \b at its end
+    // see the right context.
+    Py_ssize_t len = reader->len;
+    Py_ssize_t lo;
+    if (self->after_empty && (reader->eof || len - self->next > self->max_match_len)) {
+      // As in _search_state_next: where an empty match ended, take the
+      // longest match if it is non-empty, or else resume one byte on.  Like
+      // finditer, this differs from re for lazy quantifiers.
+      self->after_empty = false;
+      StringPiece match;
+      if (self->longest != NULL &&
+          _stream_iterator_match(self, self->longest, RE2::ANCHOR_START, &match) &&
+          !match.empty()) {
+        return _stream_iterator_result(self, match);
       }
-      return ret;
+      self->next++;
+      continue;
+    }
+    if (self->next <= len && !self->after_empty) {
+      StringPiece match;
+      bool found = _stream_iterator_match(self, re, RE2::UNANCHORED, &match);
+      Py_ssize_t start = found ? match.data() - _stream_reader_data(reader) : len;
+      if (found && (reader->eof || len - start > self->max_match_len)) {
+        return _stream_iterator_result(self, match);
+      }
+      if (reader->eof) {
+        return NULL;
+      }
+      // Anything starting before lo would have been found whole.
+      lo = std::max(self->next, std::min(start, len - self->max_match_len));
+    } else if (reader->eof) {
+      return NULL;
+    } else {
+      lo = self->next;
+    }
+
+    Py_ssize_t cut = std::min(len, std::max<Py_ssize_t>(0, lo - 1));
+    _stream_reader_discard(reader, cut);
+    self->next = lo - cut;
+    if (!_stream_reader_fill(reader)) {
+      return NULL;
+    }
+  }
+}
+
+static PyObject*
+regexp_set_match_stream(RegexpSetObject2* self, PyObject* args, PyObject* kwds)
+{
+  if (!self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't match_stream() on an uncompiled Set");
+    return NULL;
+  }
+  StreamReader reader;
+  Py_ssize_t max_match_len;
+  if (!_stream_reader_init(args, kwds, "O|nn:match_stream", &reader, &max_match_len)) {
+    _stream_reader_release(&reader);
+    return NULL;
+  }
+
+  // Match each window, keeping the last max_match_len bytes of one at the
+  // start of the next so that matches spanning chunks are seen whole.
+  std::vector<char> found(self->size);
+  std::vector<int> idxes;
+  bool ok = true;
+  while (ok && !reader.eof) {
+    _stream_reader_discard(&reader, std::max<Py_ssize_t>(0, reader.len - max_match_len));
+    Py_ssize_t kept = reader.len;
+    ok = _stream_reader_fill(&reader);
+    if (!ok || (reader.eof && reader.base + kept > 0)) {
+      // Nothing new to match, unless the stream is empty.
+      break;
+    }
+    StringPiece text(reader.len > 0 ? &(*reader.buf)[0] : "", reader.len);
+    bool matched;
+    if (reader.len >= GIL_RELEASE_THRESHOLD) {
+      Py_BEGIN_ALLOW_THREADS
+      matched = self->re2_set_obj->Match(text, &idxes);
+      Py_END_ALLOW_THREADS
+    } else {
+      matched = self->re2_set_obj->Match(text, &idxes);
+    }
+    for (size_t i = 0; matched && i < idxes.size(); i++) {
+      found[idxes[i]] = 1;
+    }
+  }
+  _stream_reader_release(&reader);
+  if (!ok) {
+    return NULL;
+  }
+
+  PyObject* match_indexes = PyList_New(0);
+  for (int i = 0; match_indexes != NULL && i < self->size; i++) {
+    if (found[i]) {
+      PyObject* index = PyLong_FromLong(i);
+      if (index == NULL || PyList_Append(match_indexes, index) < 0) {
+        Py_CLEAR(match_indexes);
+      }
+      Py_XDECREF(index);
+    }
+  }
+  return match_indexes;
+}
+
+static void
+filtered_set_dealloc(FilteredSetObject2* self)
+{
+  delete self->atoms;
+  delete self->filtered;
+  delete self->options;
+  PyObject_Del(self);
+}
+
+static PyObject*
+filtered_set_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  int min_atom_len = 0;
+  int flags = 0;
+
+  if (!PyArg_ParseTuple(args, "|ii:FilteredSet", &min_atom_len, &flags)) {
+    return NULL;
+  }
+  // min_atom_len, flags and atom_max_mem may also be passed by keyword;
+  // anything else is an RE2 option.
+  static const char* const filtered_kwlist[] = {"min_atom_len", "flags", "atom_max_mem", NULL};
+  PY_LONG_LONG atom_max_mem = 0;
+  PyObject* value;
+  if (kwds != NULL && (value = PyDict_GetItemString(kwds, "min_atom_len")) != NULL) {
+    min_atom_len = (int)PyLong_AsLong(value);
+    if (min_atom_len == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+  }
+  if (kwds != NULL && (value = PyDict_GetItemString(kwds, "flags")) != NULL) {
+    flags = (int)PyLong_AsLong(value);
+    if (flags == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+  }
+  if (min_atom_len < 0) {
+    PyErr_SetString(PyExc_ValueError, "min_atom_len must not be negative");
+    return NULL;
+  }
+  if (kwds != NULL && (value = PyDict_GetItemString(kwds, "atom_max_mem")) != NULL &&
+      value != Py_None) {
+    atom_max_mem = PyLong_AsLongLong(value);
+    if (atom_max_mem == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+    if (atom_max_mem <= 0) {
+      PyErr_SetString(PyExc_ValueError, "atom_max_mem must be positive");
+      return NULL;
+    }
+  }
+
+  RE2::Options options;
+  if (!_parse_options(flags, kwds, filtered_kwlist, &options)) {
+    return NULL;
   }
+
+  FilteredSetObject2* self = (FilteredSetObject2*)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    return NULL;
+  }
+  self->compiled = false;
+  self->busy = false;
+  self->flags = flags;
+  self->atoms = NULL;
+  self->atom_max_mem = atom_max_mem;
+  self->n_atoms = 0;
+  self->atom_bytes = 0;
+  self->n_unfiltered = 0;
+  self->program_size = 0;
+  self->n_texts = 0;
+  self->n_unfiltered_texts = 0;
+  self->n_candidates = 0;
+  self->n_matches = 0;
+  self->options = new(nothrow) RE2::Options(options);
+  self->filtered = new(nothrow) FilteredRE2(min_atom_len);
+  if (self->options == NULL || self->filtered == NULL) {
+    PyErr_NoMemory();
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject*)self;
 }
 
 static PyObject*
-match_groups(MatchObject2* self, PyObject* args, PyObject* kwds)
+filtered_set_add(FilteredSetObject2* self, PyObject* pattern)
 {
-  static const char* kwlist[] = {
-    "default",
-    NULL};
-
-  PyObject* default_obj = Py_None;
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)kwlist,
-        &default_obj)) {
+  if (self->compiled) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add() on an already compiled FilteredSet");
     return NULL;
   }
-
-  int ngroups = ((RegexpObject2*)self->re)->re2_obj->NumberOfCapturingGroups();
-
-  PyObject* ret = PyTuple_New(ngroups);
-  if (ret == NULL) {
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't add() while the FilteredSet is busy in another thread");
     return NULL;
   }
-
-  for (int i = 1; i <= ngroups; i++) {
-    PyObject* group = _group_get_i(self, i, default_obj);
-    if (group == NULL) {
-      Py_DECREF(ret);
-      return NULL;
-    }
-    PyTuple_SET_ITEM(ret, i-1, group);
+  if (!PyObject_TypeCheck(pattern, REGEX_OBJECT_TYPE)) {
+    PyErr_SetString(PyExc_TypeError, "expected str pattern");
+    return NULL;
   }
 
-  return ret;
+  bool prefix = _multiline_prefix(self->flags, *self->options);
+  std::string effective;
+  if (!_effective_pattern(pattern, prefix, &effective)) {
+    return NULL;
+  }
+  int id;
+  if (self->filtered->Add(effective, *self->options, &id) != RE2::NoError) {
+    // FilteredRE2 only reports the error code, so recompile for the message.
+    RE2 re(effective, *self->options);
+    std::string msg = _pattern_error(effective, prefix, *self->options, re.error());
+    PyErr_SetString(PyExc_ValueError, msg.c_str());
+    return NULL;
+  }
+  self->program_size += self->filtered->GetRE2(id).ProgramSize();
+  return PyLong_FromLong(id);
 }
 
 static PyObject*
-match_groupdict(MatchObject2* self, PyObject* args, PyObject* kwds)
+filtered_set_compile(FilteredSetObject2* self)
 {
-  static const char* kwlist[] = {
-    "default",
-    NULL};
+  if (self->compiled) {
+    Py_RETURN_NONE;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Can't compile() while the FilteredSet is busy in another thread");
+    return NULL;
+  }
 
-  PyObject* default_obj = Py_None;
+  // FilteredRE2 refuses to compile without any regexps; an empty set just
+  // never matches.
+  if (self->filtered->NumRegexps() == 0) {
+    self->compiled = true;
+    Py_RETURN_NONE;
+  }
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)kwlist,
-        &default_obj)) {
+  bool ok = true;
+  self->busy = true;
+  Py_BEGIN_ALLOW_THREADS
+  std::vector<std::string> atoms;
+  self->filtered->Compile(&atoms);
+
+  // The atoms are lowercased, so scan for them case-insensitively.  An
+  // RE2::Set of literals compiles to a DFA that finds them all in one pass.
+  if (!atoms.empty()) {
+    for (size_t i = 0; i < atoms.size(); i++) {
+      self->atom_bytes += atoms[i].size();
+    }
+    // The atoms' program and DFA grow with the atoms, not with any one
+    // pattern, so they get a budget of their own: unless set, enough for
+    // ATOM_MEM_PER_BYTE bytes of memory per byte of atoms.
+    PY_LONG_LONG max_mem = self->atom_max_mem;
+    if (max_mem == 0) {
+      max_mem = std::max<PY_LONG_LONG>(self->options->max_mem(),
+          (PY_LONG_LONG)self->atom_bytes * ATOM_MEM_PER_BYTE);
+    }
+    RE2::Options options;
+    options.set_log_errors(false);
+    options.set_literal(true);
+    options.set_case_sensitive(false);
+    options.set_max_mem(max_mem);
+    self->atoms = new(nothrow) RE2::Set(options, RE2::UNANCHORED);
+    for (size_t i = 0; ok && i < atoms.size(); i++) {
+      ok = self->atoms != NULL && self->atoms->Add(atoms[i], NULL) == (int)i;
+    }
+    ok = ok && self->atoms->Compile();
+  }
+  self->n_atoms = atoms.size();
+
+  // Patterns without usable atoms pass the filter whatever the text.
+  std::vector<int> no_atoms;
+  std::vector<int> unfiltered;
+  self->filtered->AllPotentials(no_atoms, &unfiltered);
+  self->n_unfiltered = unfiltered.size();
+  Py_END_ALLOW_THREADS
+  self->busy = false;
+
+  if (!ok) {
+    PyErr_SetString(PyExc_MemoryError, "Ran out of memory compiling the FilteredSet's atoms");
     return NULL;
   }
+  self->compiled = true;
+  Py_RETURN_NONE;
+}
 
-  PyObject* ret = PyDict_New();
-  if (ret == NULL) {
-    return NULL;
+/**
+ * Collect the indexes of the patterns in self that match text in v, in
+ * ascending order, stopping at the first match if first_only.  fname
+ * names the method for errors.  Return false on failure (exception).
+ */
+static bool
+_filtered_set_match(FilteredSetObject2* self, PyObject* text, const char* fname,
+    bool first_only, std::vector<int>* v)
+{
+  if (!self->compiled) {
+    PyErr_Format(PyExc_RuntimeError, "Can't %s() on an uncompiled FilteredSet", fname);
+    return false;
   }
 
-  const std::map<std::string, int>& name_map = ((RegexpObject2*)self->re)->re2_obj->NamedCapturingGroups();
-  for (std::map<std::string, int>::const_iterator it = name_map.begin(); it != name_map.end(); ++it) {
-    PyObject* group = _group_get_i(self, it->second, default_obj);
-    if (group == NULL) {
-      Py_DECREF(ret);
-      return NULL;
+  Subject subject;
+  if (!_subject_get(text, &subject, "expected str or a bytes-like object", false)) {
+    return false;
+  }
+  StringPiece piece(subject.data, subject.size);
+  Py_ssize_t n_candidates = 0;
+  Py_ssize_t n_unfiltered_texts = 0;
+
+  PyThreadState* thread_state = subject.size >= GIL_RELEASE_THRESHOLD ? PyEval_SaveThread() : NULL;
+  if (self->filtered->NumRegexps() > 0) {
+    std::vector<int> atoms;
+    bool filter = true;
+    if (self->atoms != NULL) {
+      RE2::Set::ErrorInfo error;
+      if (!self->atoms->Match(piece, &atoms, &error) && error.kind != RE2::Set::kNoError) {
+        // The DFA ran out of memory, so atoms may be missing.  Rather than
+        // miss matches, try every pattern.
+        filter = false;
+      }
     }
-    // TODO: Group names with embedded zeroes?
-    int res = PyDict_SetItemString(ret, it->first.data(), group);
-    Py_DECREF(group);
-    if (res < 0) {
-      Py_DECREF(ret);
-      return NULL;
+    std::vector<int> candidates;
+    if (filter) {
+      self->filtered->AllPotentials(atoms, &candidates);
+      std::sort(candidates.begin(), candidates.end());
+    } else {
+      candidates.resize(self->filtered->NumRegexps());
+      for (size_t i = 0; i < candidates.size(); i++) {
+        candidates[i] = i;
+      }
+      n_unfiltered_texts++;
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+      n_candidates++;
+      if (RE2::PartialMatch(piece, self->filtered->GetRE2(candidates[i]))) {
+        v->push_back(candidates[i]);
+        if (first_only) {
+          break;
+        }
+      }
     }
   }
+  if (thread_state != NULL) {
+    PyEval_RestoreThread(thread_state);
+  }
+  _subject_release(&subject);
 
-  return ret;
+  self->n_texts++;
+  self->n_unfiltered_texts += n_unfiltered_texts;
+  self->n_candidates += n_candidates;
+  self->n_matches += v->size();
+  return true;
 }
 
-enum span_mode_t { START, END, SPAN };
-
 static PyObject*
-_do_span(MatchObject2* self, PyObject* args, const char* name, span_mode_t mode)
+filtered_set_match(FilteredSetObject2* self, PyObject* text)
 {
-  long idx = 0;
-  PyObject* group = NULL;
-  if (!PyArg_UnpackTuple(args, name, 0, 1,
-        &group)) {
+  std::vector<int> idxes;
+  if (!_filtered_set_match(self, text, "match", false, &idxes)) {
+    return NULL;
+  }
+  PyObject* match_indexes = PyList_New(idxes.size());
+  if (match_indexes == NULL) {
     return NULL;
   }
-  if (group != NULL) {
-    if (!_group_idx(self, group, &idx)) {
+  for (size_t i = 0; i < idxes.size(); i++) {
+    PyObject* index = PyLong_FromLong(idxes[i]);
+    if (index == NULL) {
+      Py_DECREF(match_indexes);
       return NULL;
     }
+    PyList_SET_ITEM(match_indexes, (Py_ssize_t)i, index);
   }
-
-  Py_ssize_t start = - 1;
-  Py_ssize_t end = - 1;
-
-  (void)_group_span(self, idx, &start, &end);
-  switch (mode) {
-    case START : return Py_BuildValue("n", start );
-    case END   : return Py_BuildValue("n", end   );
-    case SPAN:
-      return Py_BuildValue("nn", start, end);
-  }
-
-  // Make gcc happy.
-  return NULL;
+  return match_indexes;
 }
 
 static PyObject*
-match_start(MatchObject2* self, PyObject* args)
+filtered_set_test(FilteredSetObject2* self, PyObject* text)
 {
-  return _do_span(self, args, "start", START);
+  std::vector<int> idxes;
+  if (!_filtered_set_match(self, text, "test", true, &idxes)) {
+    return NULL;
+  }
+  return PyBool_FromLong(!idxes.empty());
 }
 
 static PyObject*
-match_end(MatchObject2* self, PyObject* args)
+filtered_set_stats(FilteredSetObject2* self)
 {
-  return _do_span(self, args, "end", END);
+  return Py_BuildValue("{sisnsnsnsnsnsnsnsn}",
+      "patterns", self->filtered->NumRegexps(),
+      "atoms", self->n_atoms,
+      "atom_bytes", self->atom_bytes,
+      "unfiltered", self->n_unfiltered,
+      "program_size", self->program_size,
+      "texts", self->n_texts,
+      "unfiltered_texts", self->n_unfiltered_texts,
+      "candidates", self->n_candidates,
+      "matches", self->n_matches);
 }
 
-static PyObject*
-match_span(MatchObject2* self, PyObject* args)
-{
-  return _do_span(self, args, "span", SPAN);
-}
 
+// The compile cache maps (pattern, error class, flags, options) keys to
+// compiled regexps.  The dict holds the references; the regexps themselves
+// form a list from most to least recently used, so the one to evict is
+// always at hand.
+// All of this is protected by the GIL, which is never released while the
+// cache is being updated.  Only exact str patterns are cached, so hashing
+// and comparing keys can't run Python code.
+static PyObject* cache_dict = NULL;
+static RegexpObject2* cache_newest = NULL;
+static RegexpObject2* cache_oldest = NULL;
+static Py_ssize_t cache_maxsize = 512;
+static Py_ssize_t cache_hits = 0;
+static Py_ssize_t cache_misses = 0;
+static Py_ssize_t cache_evictions = 0;
 
 static void
-regexp_set_dealloc(RegexpSetObject2* self)
+_cache_unlink(RegexpObject2* regexp)
 {
-  delete self->re2_set_obj;
-  PyObject_Del(self);
+  if (regexp->cache_newer != NULL) {
+    regexp->cache_newer->cache_older = regexp->cache_older;
+  } else {
+    cache_newest = regexp->cache_older;
+  }
+  if (regexp->cache_older != NULL) {
+    regexp->cache_older->cache_newer = regexp->cache_newer;
+  } else {
+    cache_oldest = regexp->cache_newer;
+  }
+  regexp->cache_newer = NULL;
+  regexp->cache_older = NULL;
 }
 
-static PyObject*
-regexp_set_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+static void
+_cache_push(RegexpObject2* regexp)
 {
-    int anchoring = RE2::UNANCHORED;
-
-    if (!PyArg_ParseTuple(args, "|I", &anchoring)) {
-      anchoring = -1;
-    }
-
-    switch (anchoring) {
-      case RE2::UNANCHORED:
-      case RE2::ANCHOR_START:
-      case RE2::ANCHOR_BOTH:
-        break;
-      default:
-        PyErr_SetString(PyExc_ValueError,
-          "anchoring must be one of re2.UNANCHORED, re2.ANCHOR_START, or re2.ANCHOR_BOTH");
-        return NULL;
-    }
-
-    RegexpSetObject2* self = (RegexpSetObject2*)type->tp_alloc(type, 0);
+  regexp->cache_newer = NULL;
+  regexp->cache_older = cache_newest;
+  if (cache_newest != NULL) {
+    cache_newest->cache_newer = regexp;
+  } else {
+    cache_oldest = regexp;
+  }
+  cache_newest = regexp;
+}
 
-    if (self == NULL) {
-      return NULL;
+/**
+ * Drop the least recently used regexps until at most maxsize are cached.
+ */
+static void
+_cache_trim(Py_ssize_t maxsize, bool count_evictions)
+{
+  while (cache_oldest != NULL && PyDict_Size(cache_dict) > maxsize) {
+    RegexpObject2* regexp = cache_oldest;
+    _cache_unlink(regexp);
+    PyObject* key = regexp->cache_key;
+    regexp->cache_key = NULL;
+    // This may free the regexp, but can't reenter the cache.
+    if (PyDict_DelItem(cache_dict, key) < 0) {
+      PyErr_Clear();
     }
-    self->compiled = false;
-    self->re2_set_obj = NULL;
-
-    RE2::Options options;
-    options.set_log_errors(false);
-
-    self->re2_set_obj = new(nothrow) RE2::Set(options, (RE2::Anchor)anchoring);
-
-    if (self->re2_set_obj == NULL) {
-      PyErr_NoMemory();
-      Py_DECREF(self);
-      return NULL;
+    Py_DECREF(key);
+    if (count_evictions) {
+      cache_evictions++;
     }
-
-    return (PyObject*)self;
+  }
 }
 
 static PyObject*
-regexp_set_add(RegexpSetObject2* self, PyObject* pattern)
+_compile(PyObject* self, PyObject* args, PyObject* kwds)
 {
-  if (self->compiled) {
-    PyErr_SetString(PyExc_RuntimeError, "Can't add() on an already compiled Set");
+  PyObject *pattern;
+  PyObject *error_class;
+  int flags = 0;
+
+  if (!PyArg_ParseTuple(args, "O!O|i:_compile",
+                                   REGEX_OBJECT_TYPE, &pattern,
+                                   &error_class, &flags)) {
     return NULL;
   }
 
-  Py_ssize_t len_pattern;
-#if PY_MAJOR_VERSION >= 3
-  const char* raw_pattern = PyUnicode_AsUTF8AndSize(pattern, &len_pattern);
-  if (!raw_pattern) {
+  RE2::Options options;
+  if (!_parse_options(flags, kwds, NULL, &options)) {
     return NULL;
   }
-#else
-  const char* raw_pattern = PyString_AsString(pattern);
-  if (!raw_pattern) {
-    return NULL;
+
+  if (cache_maxsize <= 0 || !PyUnicode_CheckExact(pattern)) {
+    return create_regexp(self, pattern, error_class, flags, options);
   }
-  len_pattern = PyString_GET_SIZE(pattern);
-#endif
-  std::string add_error;
-  int seq = self->re2_set_obj->Add(StringPiece(raw_pattern, (int)len_pattern), &add_error);
 
-  if (seq < 0) {
-    PyErr_SetString(PyExc_ValueError, add_error.c_str());
+  PyObject* options_key = _options_key(options);
+  if (options_key == NULL) {
     return NULL;
   }
+  PyObject* key = Py_BuildValue("OOiN", pattern, error_class, flags, options_key);
+  if (key == NULL) {
+    return NULL;
+  }
+  PyObject* cached = PyDict_GetItem(cache_dict, key);
+  if (cached != NULL) {
+    Py_DECREF(key);
+    cache_hits++;
+    if ((RegexpObject2*)cached != cache_newest) {
+      _cache_unlink((RegexpObject2*)cached);
+      _cache_push((RegexpObject2*)cached);
+    }
+    Py_INCREF(cached);
+    return cached;
+  }
 
-  return PyLong_FromLong(seq);
+  cache_misses++;
+  PyObject* regexp = create_regexp(self, pattern, error_class, flags, options);
+  if (regexp == NULL) {
+    Py_DECREF(key);
+    return NULL;
+  }
+  if (PyDict_SetItem(cache_dict, key, regexp) < 0) {
+    // An unhashable error class; just don't cache.
+    PyErr_Clear();
+    Py_DECREF(key);
+    return regexp;
+  }
+  ((RegexpObject2*)regexp)->cache_key = key;
+  _cache_push((RegexpObject2*)regexp);
+  _cache_trim(cache_maxsize, true);
+  return regexp;
 }
 
 static PyObject*
-regexp_set_compile(RegexpSetObject2* self)
+_cache_info(PyObject* self, PyObject* args)
 {
-  if (self->compiled) {
-    Py_RETURN_NONE;
-  }
+  return Py_BuildValue("nnnnn", cache_hits, cache_misses, cache_evictions,
+      cache_maxsize, PyDict_Size(cache_dict));
+}
 
-  bool compiled = self->re2_set_obj->Compile();
+static PyObject*
+_cache_clear(PyObject* self, PyObject* args)
+{
+  _cache_trim(0, false);
+  cache_hits = 0;
+  cache_misses = 0;
+  cache_evictions = 0;
+  Py_RETURN_NONE;
+}
 
-  if (!compiled) {
-    PyErr_SetString(PyExc_MemoryError, "Ran out of memory during regexp compile");
+static PyObject*
+_cache_set_size(PyObject* self, PyObject* args)
+{
+  Py_ssize_t maxsize;
+  if (!PyArg_ParseTuple(args, "n:_cache_set_size", &maxsize)) {
     return NULL;
   }
-
-  self->compiled = true;
+  if (maxsize < 0) {
+    PyErr_SetString(PyExc_ValueError, "cache size must not be negative");
+    return NULL;
+  }
+  cache_maxsize = maxsize;
+  _cache_trim(maxsize, true);
   Py_RETURN_NONE;
 }
 
 static PyObject*
-regexp_set_match(RegexpSetObject2* self, PyObject* text)
+_compile_many(PyObject* self, PyObject* args, PyObject* kwds)
 {
-  if (!self->compiled) {
-    PyErr_SetString(PyExc_RuntimeError, "Can't match() on an uncompiled Set");
+  PyObject* patterns;
+  PyObject* error_class;
+  int flags = 0;
+  int num_threads = 1;
+
+  if (!PyArg_ParseTuple(args, "OOii:_compile_many",
+        &patterns, &error_class, &flags, &num_threads)) {
+    return NULL;
+  }
+  RE2::Options options;
+  if (!_parse_options(flags, kwds, NULL, &options)) {
     return NULL;
   }
 
-  const char* raw_text;
-  Py_ssize_t len_text;
-#if PY_MAJOR_VERSION >= 3
-  if (PyUnicode_Check(text)) {
-    raw_text = PyUnicode_AsUTF8AndSize(text, &len_text);
-  } else if (PyBytes_Check(text)) {
-    raw_text = PyBytes_AS_STRING(text);
-    len_text = PyBytes_GET_SIZE(text);
-  } else {
-    PyErr_SetString(PyExc_TypeError, "expected str or bytes");
+  // A tuple of the patterns, as the caller's list could change while the
+  // GIL is released, and they are needed again afterwards.
+  PyObject* fast = PySequence_Fast(patterns, "expected a sequence of patterns");
+  if (fast == NULL) {
     return NULL;
   }
-#else
-  raw_text = PyString_AsString(text);
-  if (raw_text == NULL) {
+  PyObject* seq = PySequence_Tuple(fast);
+  Py_DECREF(fast);
+  if (seq == NULL) {
     return NULL;
   }
-  len_text = PyString_GET_SIZE(text);
-#endif
-
-  std::vector<int> idxes;
-  bool matched = self->re2_set_obj->Match(StringPiece(raw_text, (int)len_text), &idxes);
-
-  if (matched) {
-    PyObject* match_indexes = PyList_New(idxes.size());
-
-    for(std::vector<int>::size_type i = 0; i < idxes.size(); ++i) {
-      PyList_SET_ITEM(match_indexes, (Py_ssize_t)i, PyLong_FromLong(idxes[i]));
+  Py_ssize_t n_patterns = PySequence_Fast_GET_SIZE(seq);
+  num_threads = _batch_threads(num_threads, n_patterns);
+  if (num_threads == 0) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  std::vector<std::string> effective(n_patterns);
+  for (Py_ssize_t i = 0; i < n_patterns; i++) {
+    PyObject* pattern = PySequence_Fast_GET_ITEM(seq, i);
+    if (!PyObject_TypeCheck(pattern, REGEX_OBJECT_TYPE)) {
+      PyErr_Format(PyExc_TypeError, "expected str pattern at index %zd", i);
+      Py_DECREF(seq);
+      return NULL;
+    }
+    if (!_effective_pattern(pattern, _multiline_prefix(flags, options), &effective[i])) {
+      Py_DECREF(seq);
+      return NULL;
     }
-
-    return match_indexes;
-  } else {
-    return PyList_New(0);
   }
-}
-
-
-static PyObject*
-_compile(PyObject* self, PyObject* args)
-{
-  PyObject *pattern;
-  PyObject *error_class;
 
-  if (!PyArg_ParseTuple(args, "O!O:_compile",
-                                   REGEX_OBJECT_TYPE, &pattern,
-                                   &error_class)) {
-    return NULL;
+  // Parsing and compiling need nothing from Python.
+  std::vector<RE2*> compiled(n_patterns);
+  Py_BEGIN_ALLOW_THREADS
+  _parallel_for(n_patterns, num_threads, [&](Py_ssize_t begin, Py_ssize_t end) {
+    for (Py_ssize_t i = begin; i < end; i++) {
+      compiled[i] = new(nothrow) RE2(effective[i], options);
+    }
+  });
+  Py_END_ALLOW_THREADS
+
+  PyObject* result = PyList_New(n_patterns);
+  for (Py_ssize_t i = 0; i < n_patterns; i++) {
+    if (result == NULL) {
+      delete compiled[i];
+      continue;
+    }
+    PyObject* item = _wrap_regexp(PySequence_Fast_GET_ITEM(seq, i), error_class, flags, compiled[i]);
+    if (item == NULL && PyErr_ExceptionMatches(error_class)) {
+      // Bad patterns are reported in place, so one doesn't hide the rest.
+      PyObject *type, *value, *traceback;
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
+      Py_XDECREF(type);
+      Py_XDECREF(traceback);
+      item = value;
+    }
+    if (item == NULL) {
+      Py_CLEAR(result);
+      continue;
+    }
+    PyList_SET_ITEM(result, i, item);
   }
-
-  return create_regexp(self, pattern, error_class);
+  Py_DECREF(seq);
+  return result;
 }
 
 static PyObject*
@@ -1032,7 +5260,7 @@ escape(PyObject* self, PyObject* args)
     return NULL;
   }
 
-  std::string esc(RE2::QuoteMeta(StringPiece(str, (int)len)));
+  std::string esc(RE2::QuoteMeta(StringPiece(str, len)));
 
 #if PY_MAJOR_VERSION >= 3
   return PyUnicode_FromStringAndSize(esc.c_str(), esc.size());
@@ -1043,6 +5271,10 @@ escape(PyObject* self, PyObject* args)
 
 static PyMethodDef methods[] = {
   {"_compile", (PyCFunction)_compile, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"_compile_many", (PyCFunction)_compile_many, METH_VARARGS | METH_KEYWORDS, NULL},
+  {"_cache_info", (PyCFunction)_cache_info, METH_NOARGS, NULL},
+  {"_cache_clear", (PyCFunction)_cache_clear, METH_NOARGS, NULL},
+  {"_cache_set_size", (PyCFunction)_cache_set_size, METH_VARARGS, NULL},
   {"escape", (PyCFunction)escape, METH_VARARGS,
    "Escape all potentially meaningful regexp characters."},
   {NULL}  /* Sentinel */
@@ -1087,6 +5319,27 @@ init_re2(void)
     INITERROR;
   }
 
+  if (PyType_Ready(&Iterator_Type2) < 0) {
+    INITERROR;
+  }
+
+  if (PyType_Ready(&Array_Type2) < 0) {
+    INITERROR;
+  }
+
+  if (PyType_Ready(&FilteredSet_Type2) < 0) {
+    INITERROR;
+  }
+
+  if (PyType_Ready(&StreamIterator_Type2) < 0) {
+    INITERROR;
+  }
+
+  cache_dict = PyDict_New();
+  if (cache_dict == NULL) {
+    INITERROR;
+  }
+
 #if PY_MAJOR_VERSION >= 3
   PyObject* mod = PyModule_Create(&moduledef);
 #else
@@ -1096,6 +5349,9 @@ init_re2(void)
   Py_INCREF(&RegexpSet_Type2);
   PyModule_AddObject(mod, "Set", (PyObject*)&RegexpSet_Type2);
 
+  Py_INCREF(&FilteredSet_Type2);
+  PyModule_AddObject(mod, "FilteredSet", (PyObject*)&FilteredSet_Type2);
+
   PyModule_AddIntConstant(mod, "UNANCHORED", RE2::UNANCHORED);
   PyModule_AddIntConstant(mod, "ANCHOR_START", RE2::ANCHOR_START);
   PyModule_AddIntConstant(mod, "ANCHOR_BOTH", RE2::ANCHOR_BOTH);
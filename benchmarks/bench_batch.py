@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+# Copyright (c) Facebook, Inc. and its affiliates.
+"""Measure batch matching throughput as num_threads grows.
+
+A batch of synthetic URLs is classified with Set.match_many and filtered
+with Regexp.test_many, each at several thread counts.  The results are
+checked against the single-threaded run, so the order must not depend on
+how the work was split.
+"""
+
+import argparse
+import os
+import random
+import time
+
+import re2
+
+
+PATTERNS = [
+    r"^https?://[^/]*\.example\.com/",
+    r"/admin(/|$)",
+    r"\.(png|jpe?g|gif|webp)(\?|$)",
+    r"[?&]utm_[a-z]+=",
+    r"/api/v[0-9]+/users/[0-9]+",
+    r"(?i)login|signin|auth",
+    r"\.php\?",
+    r"/static/[0-9a-f]{8,}/",
+]
+
+
+def make_urls(n, seed=0):
+    rng = random.Random(seed)
+    hosts = ["www.example.com", "cdn.example.com", "example.org", "shop.test"]
+    paths = ["admin", "api/v2/users/%d", "static/%08x", "img/%d.png",
+             "index.php?id=%d", "login", "blog/%d"]
+    urls = []
+    for _ in range(n):
+        path = rng.choice(paths)
+        if "%" in path:
+            path = path % rng.randrange(1 << 32)
+        query = "?utm_source=x" if rng.random() < 0.2 else ""
+        urls.append("https://%s/%s%s" % (rng.choice(hosts), path, query))
+    return urls
+
+
+def timed(fn, repeat):
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        result = fn()
+        best = min(best, time.perf_counter() - start)
+    return best, result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--texts", type=int, default=1000000)
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--threads", type=int, nargs="+",
+                        default=sorted({1, 2, 4, os.cpu_count() or 1}))
+    args = parser.parse_args()
+
+    urls = make_urls(args.texts)
+    s = re2.Set()
+    for pattern in PATTERNS:
+        s.add(pattern)
+    s.compile()
+    regexp = re2.compile(PATTERNS[4])
+
+    for name, fn in (("Set.match_many", s.match_many), ("Regexp.test_many", regexp.test_many)):
+        base_time, base = timed(lambda: fn(urls, num_threads=1), args.repeat)
+        base = [memoryview(a).tobytes() for a in (base if isinstance(base, tuple) else (base,))]
+        for n in args.threads:
+            elapsed, result = timed(lambda: fn(urls, num_threads=n), args.repeat)
+            result = [memoryview(a).tobytes() for a in (result if isinstance(result, tuple) else (result,))]
+            assert result == base, "results differ with %d threads" % n
+            print("%-17s threads=%-3d %10.0f texts/s  speedup %.2fx" % (
+                name, n, len(urls) / elapsed, base_time / elapsed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+#!/usr/bin/env python
+# Copyright (c) Facebook, Inc. and its affiliates.
+"""Compare grep_lines with splitting lines and calling test_search in Python.
+
+A synthetic access log is searched for server errors, once line by line
+from Python and once with Regexp.grep_lines at each thread count.
+"""
+
+import argparse
+import os
+import random
+import time
+
+import re2
+
+
+def make_log(size, seed=0):
+    rng = random.Random(seed)
+    lines = []
+    total = 0
+    while total < size:
+        line = b'10.0.%d.%d - - "GET /item/%d HTTP/1.1" %d %d' % (
+            rng.randrange(256), rng.randrange(256), rng.randrange(1 << 20),
+            rng.choice([200, 200, 200, 304, 404, 500]), rng.randrange(1 << 16))
+        lines.append(line)
+        total += len(line) + 1
+    return b"\n".join(lines) + b"\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--size-mb", type=int, default=64)
+    parser.add_argument("--threads", type=int, nargs="+",
+                        default=sorted({1, 2, 4, os.cpu_count() or 1}))
+    args = parser.parse_args()
+
+    log = make_log(args.size_mb * 1024 * 1024)
+    regexp = re2.compile(r'" 5\d\d \d+$')
+
+    start = time.perf_counter()
+    expected = [i for i, line in enumerate(log.splitlines()) if regexp.test_search(line)]
+    base = time.perf_counter() - start
+    print("python loop          %8.1f MB/s" % (len(log) / base / 1e6))
+
+    for n in args.threads:
+        start = time.perf_counter()
+        lines = regexp.grep_lines(log, num_threads=n)
+        elapsed = time.perf_counter() - start
+        assert list(lines) == expected
+        print("grep_lines threads=%-2d %8.1f MB/s  speedup %.2fx" % (
+            n, len(log) / elapsed / 1e6, base / elapsed))
+
+
+if __name__ == "__main__":
+    main()
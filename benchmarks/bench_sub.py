@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+# Copyright (c) Facebook, Inc. and its affiliates.
+"""Compare re2 and re substitution on a synthetic log.
+
+The subject is a series of access-log lines, each containing an IP address
+and an email address to be redacted.  Both a template replacement and a
+callable replacement are timed.
+"""
+
+import argparse
+import re
+import time
+
+import re2
+
+
+LINE = ("10.0.%d.%d - - [16/Oct/2026:12:00:00] \"GET /u/%d HTTP/1.1\" 200 "
+        "user%d@example.com agent=curl/7.68\n")
+
+
+def make_subject(size):
+    lines = []
+    total = 0
+    i = 0
+    while total < size:
+        line = LINE % (i % 256, i % 251, i, i)
+        lines.append(line)
+        total += len(line)
+        i += 1
+    return "".join(lines)
+
+
+def timed(fn):
+    start = time.perf_counter()
+    result = fn()
+    return time.perf_counter() - start, result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--size-mb", type=int, default=100)
+    parser.add_argument("--bytes", action="store_true",
+                        help="use a bytes subject instead of str")
+    args = parser.parse_args()
+
+    subject = make_subject(args.size_mb * 1024 * 1024)
+    pattern = r"(\d+)\.\d+\.\d+\.\d+|([\w.]+)@([\w.]+)"
+    template = r"<\1\2@\3>"
+    if args.bytes:
+        subject = subject.encode("ascii")
+        pattern = pattern.encode("ascii")
+        template = template.encode("ascii")
+
+    def callback(m):
+        return m.group(3) or m.group(1)
+
+    regexps = [("re", re.compile(pattern)), ("re2", re2.compile(pattern))]
+    for label, repl in (("template", template), ("callable", callback)):
+        for name, regexp in regexps:
+            elapsed, _ = timed(lambda: regexp.sub(repl, subject))
+            print("%-8s %-4s %8.1f MB/s" % (label, name, len(subject) / elapsed / 1e6))
+
+
+if __name__ == "__main__":
+    main()
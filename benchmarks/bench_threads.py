@@ -0,0 +1,49 @@
+#!/usr/bin/env python
+# Copyright (c) Facebook, Inc. and its affiliates.
+"""Measure search throughput on large subjects as the thread count grows.
+
+Each worker repeatedly runs test_search over a multi-megabyte subject that
+does not match, so the whole buffer is scanned every time.  With the GIL
+released around RE2::Match the aggregate throughput should scale with the
+number of threads up to the number of available cores.
+"""
+
+import argparse
+import threading
+import time
+
+import re2
+
+
+def run(regexp, subject, n_threads, iterations):
+    def worker():
+        for _ in range(iterations):
+            regexp.test_search(subject)
+
+    threads = [threading.Thread(target=worker) for _ in range(n_threads)]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--size-mb", type=int, default=8)
+    parser.add_argument("--iterations", type=int, default=10)
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8])
+    args = parser.parse_args()
+
+    subject = b"GET /index.html HTTP/1.1\r\n" * (args.size_mb * 1024 * 1024 // 26)
+    regexp = re2.compile(r"(?i)content-length:\s*\d{12,}")
+
+    for n in args.threads:
+        elapsed = run(regexp, subject, n, args.iterations)
+        scanned = len(subject) * n * args.iterations
+        print("threads=%-3d %8.1f MB/s" % (n, scanned / elapsed / 1e6))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,343 @@
+#!/usr/bin/env python
+# Copyright (c) Facebook, Inc. and its affiliates.
+"""Benchmark re2 against re and record the results as JSON.
+
+Covers compile time, per-call latency on short strings, throughput on
+large buffers, capture-heavy patterns, Set sizes from 10 to 100k
+patterns, and multithreaded scaling.  Every case is timed as the best of
+several repeats, each run long enough to be measured reliably, and all
+inputs are generated from fixed seeds, so runs on the same machine are
+comparable across commits:
+
+    python benchmarks/suite.py --output before.json
+    ... change something, rebuild ...
+    python benchmarks/suite.py --output after.json
+    python benchmarks/suite.py --compare before.json after.json
+
+`make bench` runs the suite and writes bench.json.
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import re
+import subprocess
+import sys
+import threading
+import time
+
+# Imported by main() once it knows it is running benchmarks, so that
+# --compare works without the extension built.
+re2 = None
+
+
+def best_time(fn, min_time, repeat):
+    """Return the best time per call of fn(), in seconds."""
+    n = 1
+    while True:
+        start = time.perf_counter()
+        for _ in range(n):
+            fn()
+        elapsed = time.perf_counter() - start
+        if elapsed >= min_time / 10 or n >= 1 << 24:
+            break
+        n *= 10
+    n = max(1, int(n * min_time / max(elapsed, 1e-9)))
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        for _ in range(n):
+            fn()
+        best = min(best, (time.perf_counter() - start) / n)
+    return best
+
+
+class Suite(object):
+    def __init__(self, min_time, repeat, only):
+        self.min_time = min_time
+        self.repeat = repeat
+        self.only = only
+        self.results = {}
+
+    def wanted(self, name):
+        return not self.only or any(name.startswith(o) for o in self.only)
+
+    def section(self, prefix):
+        """Return whether any case under prefix is wanted, to skip setup."""
+        return not self.only or any(
+            o.startswith(prefix) or prefix.startswith(o) for o in self.only)
+
+    def record(self, name, value, unit):
+        self.results[name] = {"value": value, "unit": unit}
+        print("%-48s %12.1f %s" % (name, value, unit))
+        sys.stdout.flush()
+
+    def latency(self, name, fn):
+        if self.wanted(name):
+            self.record(name, best_time(fn, self.min_time, self.repeat) * 1e9, "ns")
+
+    def throughput(self, name, fn, size):
+        if self.wanted(name):
+            elapsed = best_time(fn, self.min_time, self.repeat)
+            self.record(name, size / elapsed / 1e6, "MB/s")
+
+
+def make_words(n, seed):
+    rng = random.Random(seed)
+    letters = "abcdefghijklmnopqrstuvwxyz"
+    return ["".join(rng.choice(letters) for _ in range(rng.randint(4, 10)))
+            for _ in range(n)]
+
+
+def make_log(size, seed=0):
+    rng = random.Random(seed)
+    lines = []
+    total = 0
+    while total < size:
+        line = "10.0.%d.%d - - \"GET /item/%d HTTP/1.1\" %d %d user%d@example.com" % (
+            rng.randrange(256), rng.randrange(256), rng.randrange(1 << 20),
+            rng.choice([200, 200, 304, 404]), rng.randrange(1 << 16),
+            rng.randrange(1000))
+        lines.append(line)
+        total += len(line) + 1
+    return "\n".join(lines) + "\n"
+
+
+# (name, pattern, whether re supports it)
+COMPILE_PATTERNS = [
+    ("literal", r"hello world", True),
+    ("alternation", "|".join(make_words(50, 1)), True),
+    ("email", r"([\w.+-]+)@((?:[\w-]+\.)+)([a-z]{2,})", True),
+    ("unicode", r"(?i)\b[\p{L}\p{N}]+(?:-[\p{L}\p{N}]+)*\b", False),
+]
+
+SHORT_PATTERNS = [
+    ("literal", r"needle", "a short haystack with a needle in it"),
+    ("digits", r"\d+", "order 12345 shipped"),
+    ("miss", r"x{3}y", "a short string that doesn't match"),
+    ("groups", r"(\w+)=(\w+)", "key=value"),
+]
+
+CAPTURE_PATTERNS = [
+    ("log", r"(\d+)-(\d+)-(\d+) (\d+):(\d+):(\d+) \[(\w+)\] (\w+): (.*)",
+     "2024-01-15 12:34:56 [INFO] server: request handled in 12ms"),
+    ("url", r"(https?)://([^/:]+)(?::(\d+))?(/[^?#]*)?(?:\?([^#]*))?(?:#(.*))?",
+     "see https://www.example.com:8080/a/b/c?x=1&y=2#frag for details"),
+]
+
+
+def bench_compile(suite):
+    for name, pattern, re_ok in COMPILE_PATTERNS:
+        def compile_re2(pattern=pattern):
+            re2.purge()
+            re2.compile(pattern)
+        suite.latency("compile/%s/re2" % name, compile_re2)
+        if re_ok:
+            def compile_re(pattern=pattern):
+                re.purge()
+                re.compile(pattern)
+            suite.latency("compile/%s/re" % name, compile_re)
+        suite.latency("compile/%s/re2-cached" % name, lambda: re2.compile(pattern))
+
+
+def bench_latency(suite):
+    for name, pattern, subject in SHORT_PATTERNS:
+        for lib, regexp in (("re2", re2.compile(pattern)), ("re", re.compile(pattern))):
+            suite.latency("latency/search/%s/%s" % (name, lib), lambda: regexp.search(subject))
+            suite.latency("latency/match/%s/%s" % (name, lib), lambda: regexp.match(subject))
+        r = re2.compile(pattern)
+        suite.latency("latency/test_search/%s/re2" % name, lambda: r.test_search(subject))
+        suite.latency("latency/findall/%s/re2" % name, lambda: r.findall(subject))
+        suite.latency("latency/findall/%s/re" % name, lambda: re.findall(pattern, subject))
+
+
+def bench_throughput(suite, size):
+    if not suite.section("throughput/"):
+        return
+    log = make_log(size)
+    data = log.encode("ascii")
+    cases = [
+        ("miss", r"(?i)content-length:\s*\d{12,}"),
+        ("literal", r"user1000@example\.com"),
+        ("class", r"[A-Z]{4}\d{7}"),
+    ]
+    for name, pattern in cases:
+        # re needs a bytes pattern for bytes subjects; re2 takes either.
+        for lib, regexp, bytes_regexp in (
+                ("re2", re2.compile(pattern), re2.compile(pattern)),
+                ("re", re.compile(pattern), re.compile(pattern.encode("ascii")))):
+            suite.throughput("throughput/search/%s/str/%s" % (name, lib),
+                             lambda: regexp.search(log), len(data))
+            suite.throughput("throughput/search/%s/bytes/%s" % (name, lib),
+                             lambda: bytes_regexp.search(data), len(data))
+    email = r"[\w.]+@example\.com"
+    for lib, regexp in (("re2", re2.compile(email)), ("re", re.compile(email))):
+        suite.throughput("throughput/findall/%s" % lib, lambda: regexp.findall(log), len(data))
+        suite.throughput("throughput/sub/%s" % lib, lambda: regexp.sub("<email>", log), len(data))
+    r = re2.compile(r'" 404 ')
+    suite.throughput("throughput/grep_lines/re2", lambda: r.grep_lines(data), len(data))
+
+
+def bench_captures(suite):
+    for name, pattern, subject in CAPTURE_PATTERNS:
+        for lib, regexp in (("re2", re2.compile(pattern)), ("re", re.compile(pattern))):
+            suite.latency("captures/%s/found/%s" % (name, lib),
+                          lambda: regexp.search(subject) is not None)
+            suite.latency("captures/%s/span/%s" % (name, lib),
+                          lambda: regexp.search(subject).span())
+            suite.latency("captures/%s/groups/%s" % (name, lib),
+                          lambda: regexp.search(subject).groups())
+        texts = [subject] * 1000
+        r = re2.compile(pattern)
+        suite.latency("captures/%s/extract_many-1000/re2" % name, lambda: r.extract_many(texts))
+
+
+def bench_sets(suite, max_size):
+    text = "the quick brown fox jumps over the lazy dog " * 4
+    words = make_words(max_size, 2)
+    size = 10
+    while size <= max_size:
+        if not suite.section("set/%d/" % size):
+            size *= 10
+            continue
+        patterns = words[:size]
+
+        def build(patterns=patterns):
+            # Large sets need more than the default 8 MiB of program memory.
+            s = re2.Set(max_mem=1 << 30)
+            s.add_many(patterns)
+            s.compile()
+            return s
+        suite.latency("set/%d/compile/re2" % size, build)
+        s = build()
+        suite.latency("set/%d/match/re2" % size, lambda: s.match(text))
+        suite.latency("set/%d/test/re2" % size, lambda: s.test(text))
+        fs = re2.FilteredSet()
+        for pattern in patterns:
+            fs.add(pattern)
+        fs.compile()
+        suite.latency("set/%d/filtered_match/re2" % size, lambda: fs.match(text))
+        if size <= 1000:
+            # The usual pure-Python alternative: one big alternation.
+            alternation = re.compile("|".join(patterns))
+            suite.latency("set/%d/alternation/re" % size, lambda: alternation.findall(text))
+        size *= 10
+
+
+def bench_threads(suite, size, max_threads):
+    if not suite.section("threads/"):
+        return
+    data = make_log(size).encode("ascii")
+    regexp = re2.compile(r"(?i)content-length:\s*\d{12,}")
+    urls = make_words(100000, 3)
+    s = re2.Set()
+    s.add_many([r"^a", r"z$", r"qu", r"[xyz]{2}"])
+    s.compile()
+    n = 1
+    while n <= max_threads:
+        def search(n=n):
+            threads = [threading.Thread(target=regexp.test_search, args=(data,))
+                       for _ in range(n)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+        suite.throughput("threads/%d/test_search/re2" % n, search, len(data) * n)
+        suite.latency("threads/%d/match_many-100k/re2" % n,
+                      lambda: s.match_many(urls, num_threads=n))
+        n *= 2
+
+
+def git_revision():
+    try:
+        out = subprocess.check_output(["git", "rev-parse", "HEAD"],
+                                      stderr=subprocess.DEVNULL,
+                                      cwd=os.path.dirname(os.path.abspath(__file__)))
+        return out.decode("ascii").strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def compare(old_path, new_path, threshold):
+    with open(old_path) as f:
+        old = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    print("%-48s %12s %12s %8s" % ("case", "old", "new", "change"))
+    regressions = 0
+    for name in sorted(set(old["results"]) & set(new["results"])):
+        a = old["results"][name]
+        b = new["results"][name]
+        # Lower is better for times, higher for rates.
+        if a["unit"] == "MB/s":
+            speedup = b["value"] / a["value"]
+        else:
+            speedup = a["value"] / b["value"]
+        flag = ""
+        if speedup < 1 - threshold:
+            flag = "  slower"
+            regressions += 1
+        elif speedup > 1 + threshold:
+            flag = "  faster"
+        print("%-48s %12.1f %12.1f %7.2fx%s" % (name, a["value"], b["value"], speedup, flag))
+    print("%d regressions beyond %d%%" % (regressions, threshold * 100))
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--output", help="write the results to this JSON file")
+    parser.add_argument("--only", nargs="+", default=[],
+                        help="run only the cases whose names start with these prefixes")
+    parser.add_argument("--quick", action="store_true",
+                        help="smaller inputs and shorter timings, for a smoke test")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--max-set-size", type=int, default=100000)
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"),
+                        help="compare two result files instead of running")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="relative change reported as a regression by --compare")
+    args = parser.parse_args()
+
+    if args.compare:
+        sys.exit(compare(args.compare[0], args.compare[1], args.threshold))
+
+    global re2
+    import re2
+
+    min_time = 0.02 if args.quick else 0.2
+    repeat = 1 if args.quick else args.repeat
+    size = (1 if args.quick else 16) * 1024 * 1024
+    max_set_size = min(args.max_set_size, 1000) if args.quick else args.max_set_size
+
+    suite = Suite(min_time, repeat, args.only)
+    bench_compile(suite)
+    bench_latency(suite)
+    bench_throughput(suite, size)
+    bench_captures(suite)
+    bench_sets(suite, max_set_size)
+    bench_threads(suite, size, args.max_threads)
+
+    result = {
+        "meta": {
+            "revision": git_revision(),
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+            "python": platform.python_version(),
+            "platform": platform.platform(),
+            "cpus": os.cpu_count(),
+            "quick": args.quick,
+        },
+        "results": suite.results,
+    }
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(result, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
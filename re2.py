@@ -25,47 +25,116 @@
 # OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import _re2
+import collections
 import sre_constants
 
 __all__ = [
     "error",
     "escape",
     "compile",
+    "compile_many",
     "search",
     "match",
     "fullmatch",
+    "split",
+    "sub",
+    "subn",
     "Set",
+    "FilteredSet",
+    "A", "I", "M", "S",
+    "ASCII", "IGNORECASE", "MULTILINE", "DOTALL",
     "UNANCHORED",
     "ANCHOR_START",
     "ANCHOR_BOTH",
+    "cache_info",
+    "purge",
+    "set_cache_size",
     ]
 
-# Module-private compilation function, for future caching, other enhancements
+# Module-private compilation function.  Compiled patterns are kept in a
+# native LRU cache, so module-level calls don't recompile.
 _compile = _re2._compile
 
 error = sre_constants.error
 escape = _re2.escape
 Set = _re2.Set
+FilteredSet = _re2.FilteredSet
 UNANCHORED = _re2.UNANCHORED
 ANCHOR_START = _re2.ANCHOR_START
 ANCHOR_BOTH = _re2.ANCHOR_BOTH
 
+# The re flags RE2 can honour.  ASCII is accepted for compatibility:
+# RE2's \w, \d, \s and \b only ever match ASCII.  But RE2 folds case by
+# Unicode rules, so ASCII is rejected together with IGNORECASE.
+A = ASCII = sre_constants.SRE_FLAG_ASCII
+I = IGNORECASE = sre_constants.SRE_FLAG_IGNORECASE
+M = MULTILINE = sre_constants.SRE_FLAG_MULTILINE
+S = DOTALL = sre_constants.SRE_FLAG_DOTALL
 
-def compile(pattern):
-    "Compile a regular expression pattern, returning a pattern object."
-    return _compile(pattern, error)
 
-def search(pattern, string):
+def compile(pattern, flags=0, **options):
+    """Compile a regular expression pattern, returning a pattern object.
+
+    flags may combine IGNORECASE, MULTILINE, DOTALL and ASCII, except
+    that ASCII and IGNORECASE (or case_sensitive=False) raise ValueError,
+    as case folding is always by Unicode rules.  Keyword
+    arguments set the RE2 options of the same name: max_mem, posix_syntax,
+    longest_match, literal, never_nl, dot_nl, never_capture,
+    case_sensitive, perl_classes, word_boundary and one_line."""
+    return _compile(pattern, error, flags, **options)
+
+def compile_many(patterns, flags=0, num_threads=1, **options):
+    """Compile a sequence of patterns, returning a list of pattern objects.
+
+    The patterns are compiled without the GIL, on num_threads native
+    threads (0 for one per CPU).  A pattern that fails to compile is
+    represented in the result by the error it raised, rather than raising
+    it.  Flags and options are as for compile.  The results don't go into
+    the compile cache."""
+    return _re2._compile_many(patterns, error, flags, num_threads, **options)
+
+def search(pattern, string, flags=0):
     """Scan through string looking for a match to the pattern, returning
     a match object, or None if no match was found."""
-    return _compile(pattern, error).search(string)
+    return _compile(pattern, error, flags).search(string)
 
-def match(pattern, string):
+def match(pattern, string, flags=0):
     """Try to apply the pattern at the start of the string, returning
     a match object, or None if no match was found."""
-    return _compile(pattern, error).match(string)
+    return _compile(pattern, error, flags).match(string)
 
-def fullmatch(pattern, string):
+def fullmatch(pattern, string, flags=0):
     """Try to apply the pattern to the entire string, returning
     a match object, or None if no match was found."""
-    return _compile(pattern, error).fullmatch(string)
+    return _compile(pattern, error, flags).fullmatch(string)
+
+def split(pattern, string, maxsplit=0, flags=0):
+    """Split the source string by the occurrences of the pattern,
+    returning a list containing the resulting substrings."""
+    return _compile(pattern, error, flags).split(string, maxsplit)
+
+def sub(pattern, repl, string, count=0, flags=0):
+    """Return the string obtained by replacing the leftmost
+    non-overlapping occurrences of the pattern in string by the
+    replacement repl, which may be a template or a callable."""
+    return _compile(pattern, error, flags).sub(repl, string, count)
+
+def subn(pattern, repl, string, count=0, flags=0):
+    """Like sub, but return a tuple (new_string, number_of_subs_made)."""
+    return _compile(pattern, error, flags).subn(repl, string, count)
+
+CacheInfo = collections.namedtuple(
+    "CacheInfo", ["hits", "misses", "evictions", "maxsize", "currsize"])
+
+def cache_info():
+    "Return statistics for the compiled pattern cache, as a CacheInfo."
+    return CacheInfo(*_re2._cache_info())
+
+def purge():
+    "Clear the compiled pattern cache and reset its statistics."
+    _re2._cache_clear()
+
+def set_cache_size(maxsize):
+    """Set the number of compiled patterns to keep in the cache,
+    discarding the least recently used ones if needed.  0 disables it."""
+    _re2._cache_set_size(maxsize)
@@ -22,6 +22,7 @@ setup(
     ext_modules = [Extension("_re2",
       sources = ["_re2.cc"],
       libraries = ["re2"],
-      extra_compile_args=['-std=c++11'],
+      extra_compile_args=['-std=c++11', '-pthread'],
+      extra_link_args=['-pthread'],
       )],
     )
@@ -9,3 +9,95 @@ class TestCompile(unittest.TestCase):
             'no argument for repetition operator: \\*'
         ):
             re2.compile('*')
+
+    def test_flags(self):
+        r = re2.compile('^a.b$', re2.I | re2.M | re2.S)
+        self.assertEqual(r.flags, re2.I | re2.M | re2.S)
+        self.assertEqual(r.search('x\nA\nB\ny').span(), (2, 5))
+        self.assertEqual(re2.compile('\xe9$', re2.M).search('\xe9\n').span(), (0, 1))
+        self.assertTrue(re2.search('A', 'xa', re2.I))
+        self.assertIsNot(re2.compile('a'), re2.compile('a', re2.I))
+        self.assertRaises(ValueError, re2.compile, 'a', 64)
+        s = re2.Set(re2.UNANCHORED, re2.M | re2.I)
+        s.add('^B$')
+        s.compile()
+        self.assertEqual(s.match('a\nb\nc'), [0])
+
+    def test_ascii_flag(self):
+        # RE2's classes are ASCII-only anyway, but its case folding is not.
+        self.assertIsNone(re2.search('\\w', '\xe9', re2.A))
+        self.assertTrue(re2.search('s', '\u017f', re2.I))
+        self.assertRaises(ValueError, re2.compile, 's', re2.A | re2.I)
+        self.assertRaises(ValueError, re2.compile, 's', re2.A, case_sensitive=False)
+        self.assertRaises(ValueError, re2.Set, re2.UNANCHORED, re2.A | re2.I)
+
+    def test_multiline_options(self):
+        # POSIX syntax gets MULTILINE through one_line, and literal
+        # patterns, having no anchors, ignore it.
+        r = re2.compile('^b$', re2.M, posix_syntax=True)
+        self.assertEqual(r.search('a\nb\nc').span(), (2, 3))
+        r = re2.compile('^b$', re2.M, literal=True)
+        self.assertEqual(r.search('a^b$').span(), (1, 4))
+        self.assertIsNone(r.search('b'))
+        s = re2.Set(re2.UNANCHORED, re2.M, posix_syntax=True)
+        s.add('^b$')
+        s.add_many(['^c'])
+        s.compile()
+        self.assertEqual(s.match('a\nb\nc'), [0, 1])
+        s = re2.Set(re2.UNANCHORED, re2.M, literal=True)
+        s.add('b$')
+        s.compile()
+        self.assertEqual(s.match('ab$'), [0])
+        # Errors quote only the pattern as written.
+        with self.assertRaisesRegexp(re2.error, '^missing \\): \\($'):
+            re2.compile('(', re2.M)
+        self.assertRaisesRegexp(ValueError, '^unexpected \\): a\\)$',
+                                re2.Set(re2.UNANCHORED, re2.M).add, 'a)')
+
+    def test_options(self):
+        r = re2.compile('(a)|ab', never_capture=True, longest_match=True, max_mem=1 << 20)
+        self.assertEqual(r.groups, 0)
+        self.assertEqual(r.search('ab').span(), (0, 2))
+        self.assertEqual(r.options['max_mem'], 1 << 20)
+        self.assertTrue(r.options['longest_match'])
+        self.assertFalse(re2.compile('a').options['longest_match'])
+        self.assertIs(re2.compile('a', max_mem=1 << 20), re2.compile('a', max_mem=1 << 20))
+        self.assertRaises(TypeError, re2.compile, 'a', bogus=True)
+        self.assertRaises(ValueError, re2.compile, 'a', max_mem=0)
+        s = re2.Set(anchoring=re2.ANCHOR_BOTH, case_sensitive=False)
+        s.add('b')
+        s.compile()
+        self.assertEqual(s.match('B'), [0])
+
+    def test_compile_many(self):
+        patterns = ['a(b)', '(', '\xe9$', 'x*']
+        for n in (1, 0, 3):
+            compiled = re2.compile_many(patterns, re2.M, num_threads=n)
+            self.assertEqual(compiled[0].search('xab').group(1), 'b')
+            self.assertEqual(compiled[2].search('\xe9\nx').span(), (0, 1))
+            self.assertIsInstance(compiled[1], re2.error)
+            self.assertEqual(str(compiled[1]), 'missing ): (')
+            self.assertEqual(compiled[3].pattern, 'x*')
+        self.assertEqual(re2.compile_many([]), [])
+        self.assertEqual(re2.compile_many(['a'], never_capture=True)[0].options['never_capture'], True)
+        self.assertRaises(TypeError, re2.compile_many, ['a', 1])
+
+    def test_cache(self):
+        re2.purge()
+        try:
+            re2.set_cache_size(2)
+            a = re2.compile('a')
+            self.assertIs(re2.compile('a'), a)
+            self.assertTrue(re2.search('b', 'abc'))
+            self.assertTrue(re2.match('a', 'abc'))
+            re2.compile('c')
+            self.assertEqual(re2.cache_info(), (2, 3, 1, 2, 2))
+            self.assertIsNot(re2.compile('b'), a)
+            self.assertRaises(re2.error, re2.compile, '*')
+            self.assertRaises(re2.error, re2.compile, '*')
+            re2.set_cache_size(0)
+            self.assertIsNot(re2.compile('a'), re2.compile('a'))
+            self.assertEqual(re2.cache_info().currsize, 0)
+        finally:
+            re2.set_cache_size(512)
+            re2.purge()
@@ -0,0 +1,61 @@
+# Copyright (c) Facebook, Inc. and its affiliates.
+import random
+import unittest
+import re2
+
+class TestFilteredSet(unittest.TestCase):
+    def test_match(self):
+        patterns = ['alpha.*beta', '(?i)gamma\\d+', 'delta|epsilon', '\\d{3}', 'x*']
+        s = re2.FilteredSet()
+        for i, pattern in enumerate(patterns):
+            self.assertEqual(s.add(pattern), i)
+        self.assertRaises(RuntimeError, s.match, 'alpha')
+        s.compile()
+        compiled = [re2.compile(p) for p in patterns]
+        for text in ['alpha and beta', 'GAMMA42', 'epsilon 123', 'nothing', b'delta', 'beta alpha']:
+            expected = [i for i, r in enumerate(compiled) if r.test_search(text)]
+            self.assertEqual(s.match(text), expected)
+            self.assertEqual(s.test(text), bool(expected))
+        self.assertRaises(RuntimeError, s.add, 'zeta')
+
+    def test_stats(self):
+        s = re2.FilteredSet(min_atom_len=3, flags=re2.I)
+        s.add('hello')
+        s.add('.*')
+        s.compile()
+        self.assertEqual(s.match('Say HELLO'), [0, 1])
+        self.assertEqual(s.match(''), [1])
+        stats = s.stats()
+        self.assertEqual(stats['patterns'], 2)
+        self.assertEqual(stats['atoms'], 1)
+        self.assertEqual(stats['unfiltered'], 1)
+        self.assertEqual(stats['texts'], 2)
+        self.assertEqual(stats['unfiltered_texts'], 0)
+        self.assertGreater(stats['program_size'], 0)
+
+    def test_many_patterns(self):
+        ''' the atom matcher's budget grows with the atoms, not max_mem '''
+        rng = random.Random(2)
+        words = [''.join(rng.choice('abcdefghijklmnopqrstuvwxyz') for _ in range(rng.randint(4, 10)))
+                 for _ in range(100000)]
+        s = re2.FilteredSet()
+        for word in words:
+            s.add(word + '\\d+')
+        s.compile()
+        self.assertEqual(s.match('%s12 %s 7 %s7' % (words[5], words[6], words[99999])), [5, 99999])
+        s = re2.FilteredSet(atom_max_mem=1 << 10)
+        s.add('hello')
+        self.assertRaises(MemoryError, s.compile)
+        self.assertRaises(ValueError, re2.FilteredSet, atom_max_mem=0)
+
+    def test_errors(self):
+        s = re2.FilteredSet()
+        self.assertRaises(ValueError, s.add, '(')
+        self.assertRaises(TypeError, s.add, 3)
+        self.assertRaises(TypeError, re2.FilteredSet, bogus=True)
+        s.compile()
+        self.assertEqual(s.match('anything'), [])
+        self.assertFalse(s.test('anything'))
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,70 @@
+# Copyright (c) Facebook, Inc. and its affiliates.
+import unittest
+import re2
+
+class TestFindall(unittest.TestCase):
+    def test_findall(self):
+        self.assertEqual(re2.compile('\\d+').findall('a1b22c333'), ['1', '22', '333'])
+        self.assertEqual(re2.compile('(a)(b)?').findall('abaab'),
+                         [('a', 'b'), ('a', ''), ('a', 'b')])
+        self.assertEqual(re2.compile('x(y)').findall(b'xyzxy'), [b'y', b'y'])
+        self.assertEqual(re2.compile('\\d').findall('12345', 1, 3), ['2', '3'])
+        self.assertEqual(re2.compile('z').findall('abc'), [])
+
+    def test_finditer(self):
+        it = re2.compile('(\\w)=(\\d)').finditer('a=1 b=2 c')
+        m = next(it)
+        self.assertEqual(m.groups(), ('a', '1'))
+        self.assertEqual(m.span(), (0, 3))
+        m = next(it)
+        self.assertEqual(m.span(2), (6, 7))
+        self.assertRaises(StopIteration, next, it)
+        self.assertRaises(StopIteration, next, it)
+
+    def test_empty_matches(self):
+        ''' empty matches advance by one character, as in re '''
+        r = re2.compile('a*')
+        self.assertEqual(r.findall('baaac'), ['', 'aaa', '', ''])
+        self.assertEqual([m.span() for m in r.finditer('baaac')],
+                         [(0, 0), (1, 4), (4, 4), (5, 5)])
+        self.assertEqual(re2.compile('').findall('\xe9€'), ['', '', ''])
+        # A non-empty match may start where an empty one ended.
+        self.assertEqual(re2.compile('^|\\w+').findall('foo'), ['', 'foo'])
+        self.assertEqual(re2.compile('|a').findall('a'), ['', 'a', ''])
+        self.assertEqual([m.span() for m in re2.compile('|a').finditer('\xe9a')],
+                         [(0, 0), (1, 1), (1, 2), (2, 2)])
+        self.assertEqual(re2.compile('|(a)(b)?').findall('ab'),
+                         [('', ''), ('a', 'b'), ('', '')])
+        self.assertEqual(re2.compile('|a').sub('-', 'bab'), '-b---b-')
+        self.assertEqual(re2.compile('|a').split('bab'), ['', 'b', '', '', 'b', ''])
+
+    def test_empty_matches_lazy(self):
+        ''' after an empty match, the longest match is taken, unlike re '''
+        r = re2.compile('a*?')
+        self.assertEqual(r.findall('baac'), ['', '', 'aa', '', ''])
+        self.assertEqual(r.sub('-', 'baac'), '-b---c-')
+        self.assertEqual(r.split('baac'), ['', 'b', '', '', 'c', ''])
+        self.assertEqual(re2.compile('|a|ab').findall('xab'), ['', '', 'ab', ''])
+
+    def test_non_ascii(self):
+        r = re2.compile('(€)(.)')
+        self.assertEqual(r.findall('€x\xe9€\xe9'), [('€', 'x'), ('€', '\xe9')])
+        self.assertEqual([m.span(2) for m in r.finditer('€x\xe9€\xe9')],
+                         [(1, 2), (4, 5)])
+
+    def test_split(self):
+        self.assertEqual(re2.compile(',').split('a,b,,c'), ['a', 'b', '', 'c'])
+        self.assertEqual(re2.compile('(,)|(;)').split(b'a,b;c'),
+                         [b'a', b',', None, b'b', None, b';', b'c'])
+        self.assertEqual(re2.compile('x*').split('axbc'), ['', 'a', '', 'b', 'c', ''])
+        self.assertEqual(re2.compile('\\s+').split(' a b c ', 2), ['', 'a', 'b c '])
+        self.assertEqual(re2.split('a', 'bab', maxsplit=-1), ['bab'])
+        self.assertEqual(re2.compile('(€)').split('\xe9€b'), ['\xe9', '€', 'b'])
+        self.assertEqual(re2.split('\\d', 'a1b'), ['a', 'b'])
+        self.assertEqual(re2.compile('q').split(bytearray(b'ab')), [bytearray(b'ab')])
+
+    def test_large_subject(self):
+        subject = 'abc ' * 10000
+        self.assertEqual(len(re2.compile('b').findall(subject)), 10000)
+        self.assertEqual(sum(1 for _ in re2.compile('c').finditer(subject)), 10000)
+        self.assertEqual(re2.compile(' ').split(subject), subject.split(' '))
@@ -1,4 +1,9 @@
 # Copyright (c) Facebook, Inc. and its affiliates.
+import array
+import mmap
+import sys
+import tempfile
+import threading
 import unittest
 import re2
 
@@ -51,6 +56,38 @@ class TestMatch(unittest.TestCase):
         self.assertEqual(m.re.groups, 1)
         self.assertEqual(m.re.groupindex, {'testgroup': 1})
 
+    def test_lazy_groups(self):
+        ''' groups are extracted on first use, with the search's context '''
+        r = re2.compile('\\b(a+)(b)?\\b|(a)')
+        m = r.search('xaab aa', 1)
+        self.assertEqual(m.span(), (1, 2))
+        self.assertEqual(m.groups(), (None, None, 'a'))
+        m = r.search('xaab aa', 4)
+        self.assertEqual((m.span(1), m.span(2)), ((5, 7), (-1, -1)))
+        it = r.finditer(b'aab aa')
+        first, second = next(it), next(it)
+        self.assertEqual(second.group(1), b'aa')
+        self.assertEqual(first.groups(), (b'aa', b'b', None))
+
+        subject = '\xe9' + 'a' * 20000 + 'b'
+        m = re2.compile('(a+)(b)').search(subject)
+        self.assertEqual(m.span(2), (20001, 20002))
+        self.assertEqual(list(m.spans()), [1, 20002, 1, 20001, 20001, 20002])
+
+    def test_group_by_name(self):
+        r = re2.compile('(?P<z>a)(?P<b>b)?(c)')
+        m = r.search('xac')
+        self.assertEqual(m.group('z'), 'a')
+        self.assertIsNone(m.group('b'))
+        self.assertEqual(m.group('z', 3, 'b'), ('a', 'c', None))
+        self.assertEqual((m.start('z'), m.end('z'), m.span('b')), (1, 2, (-1, -1)))
+        self.assertRaises(IndexError, m.group, 'nope')
+        # groupdict and groupindex follow group order, as in re.
+        self.assertEqual(list(m.groupdict()), ['z', 'b'])
+        self.assertEqual(list(r.groupindex.items()), [('z', 1), ('b', 2)])
+        with self.assertRaises(TypeError):
+            r.groupindex['c'] = 3
+
     def test_compiled_match(self):
         r = re2.compile('ab([cde]fg)')
         m = r.match('abdfghij')
@@ -204,3 +241,328 @@ class TestMatch(unittest.TestCase):
 
         with self.assertRaises(TypeError):
             s.add(3)
+
+    def test_add_many(self):
+        s = re2.Set(re2.UNANCHORED, re2.M)
+        added = s.add_many(['^a', '(', 'b$'])
+        self.assertEqual(added[0], 0)
+        self.assertIsInstance(added[1], ValueError)
+        self.assertEqual(str(added[1]), 'missing ): (')
+        self.assertEqual(added[2], 1)
+        self.assertEqual(s.add('c'), 2)
+        s.compile()
+        self.assertEqual(sorted(s.match('x\na\nb\n')), [0, 1])
+        self.assertRaises(RuntimeError, s.add_many, ['d'])
+
+    def test_set_test_and_bitmap(self):
+        s = re2.Set()
+        for i in range(10):
+            s.add('p%d$' % i)
+        self.assertRaises(RuntimeError, s.test, 'p1')
+        s.compile()
+        self.assertTrue(s.test('xp7'))
+        self.assertTrue(s.test(b'p1'))
+        self.assertFalse(s.test('p'))
+        self.assertEqual(s.match('p9', as_bitmap=True), b'\x00\x02')
+        self.assertEqual(s.match('p0', True), b'\x01\x00')
+        self.assertEqual(s.match('zz', as_bitmap=True), b'\x00\x00')
+        self.assertEqual(s.match('p3', as_bitmap=False), [3])
+        self.assertRaises(TypeError, s.match, 'p3', bitmap=True)
+
+    def test_match_many(self):
+        s = re2.Set()
+        s.add('a')
+        s.add('b')
+        self.assertRaises(RuntimeError, s.match_many, ['a'])
+        s.compile()
+        offsets, indexes = s.match_many(['ab', 'x', b'b', bytearray(b'a'), 'x' * 10000 + 'b'])
+        self.assertEqual(list(offsets), [0, 2, 2, 3, 4, 5])
+        self.assertEqual(sorted(list(indexes)[0:2]), [0, 1])
+        self.assertEqual(list(indexes)[2:], [1, 0, 1])
+        view = memoryview(offsets)
+        self.assertEqual((view.format, view.itemsize, view.readonly), ('q', 8, True))
+        self.assertEqual(memoryview(indexes).tolist(), list(indexes))
+        self.assertEqual([list(r) for r in s.match_many([])], [[0], []])
+        self.assertRaises(TypeError, s.match_many, ['a', 1])
+
+    def _run_mutated(self, call):
+        ''' call(texts) while another thread keeps replacing the texts '''
+        make = lambda: [b'x' * (1 << 20) + b'ab' for _ in range(16)]
+        texts = make()
+        stop = threading.Event()
+        def mutate():
+            while not stop.is_set():
+                texts[:] = make()
+        thread = threading.Thread(target=mutate)
+        thread.start()
+        try:
+            return [call(texts) for _ in range(10)]
+        finally:
+            stop.set()
+            thread.join()
+
+    def test_batch_mutated(self):
+        ''' batches match a snapshot of the list, which other threads can change '''
+        s = re2.Set()
+        s.add('ab')
+        s.compile()
+        for offsets, indexes in self._run_mutated(lambda t: s.match_many(t, num_threads=2)):
+            self.assertEqual(list(indexes), [0] * 16)
+        r = re2.compile('ab')
+        for tested in self._run_mutated(lambda t: r.test_many(t, num_threads=4)):
+            self.assertEqual(list(tested), [True] * 16)
+        r = re2.compile('(a)b')
+        for columns in self._run_mutated(lambda t: r.extract_many(t, num_threads=2)):
+            self.assertEqual(columns[1], [b'a'] * 16)
+
+    def test_batch_threads(self):
+        ''' threaded batches give the same results, in the same order '''
+        texts = ['ab' * (i % 7) + 'c' * (i % 3) for i in range(1000)]
+        s = re2.Set()
+        s.add('ab')
+        s.add('c')
+        s.compile()
+        expected = [list(r) for r in s.match_many(texts)]
+        for n in (0, 2, 5):
+            self.assertEqual([list(r) for r in s.match_many(texts, num_threads=n)], expected)
+
+        r = re2.compile('b+c')
+        tested = r.test_many(texts)
+        self.assertEqual(list(tested), [r.test_search(t) for t in texts])
+        self.assertEqual(list(r.test_many(texts, num_threads=4)), list(tested))
+        self.assertEqual(memoryview(tested).format, '?')
+        self.assertRaises(ValueError, r.test_many, texts, num_threads=-1)
+
+    def test_extract_many(self):
+        r = re2.compile('(?P<key>\\w+)=(\\d+)?')
+        texts = ['a=1', 'nothing', 'k\xe9y=', b'b=22', bytearray(b'c=3')]
+        columns = r.extract_many(texts)
+        self.assertEqual(list(columns), ['key', 2])
+        self.assertEqual(columns['key'], ['a', None, 'y', b'b', b'c'])
+        self.assertEqual(columns[2], ['1', None, None, b'22', b'3'])
+        starts, ends = r.extract_many(texts, spans=True, num_threads=2)['key']
+        self.assertEqual(list(zip(starts, ends)), [(0, 1), (-1, -1), (2, 3), (0, 1), (0, 1)])
+        self.assertEqual(r.extract_many([]), {'key': [], 2: []})
+        self.assertEqual(re2.compile('a').extract_many(['a']), {})
+
+    def test_grep_lines(self):
+        data = b'GET /a 200\nPOST /b 500\n\nGET /c 500\nlast'
+        r = re2.compile(r' 500$')
+        self.assertEqual(list(r.grep_lines(data)), [1, 3])
+        lines, starts, ends = r.grep_lines(bytearray(data), spans=True)
+        self.assertEqual(list(zip(starts, ends)), [(11, 22), (24, 34)])
+        self.assertEqual(list(re2.compile('^$').grep_lines(data)), [2])
+        self.assertEqual(list(re2.compile('').grep_lines(b'a\n')), [0])
+        self.assertEqual(list(re2.compile('').grep_lines(b'')), [])
+        big = (data + b'\n') * 1000
+        for n in (0, 3):
+            self.assertEqual(list(r.grep_lines(big, num_threads=n)),
+                             [i * 5 + j for i in range(1000) for j in (1, 3)])
+        self.assertRaises(TypeError, r.grep_lines, 'GET /a 500')
+
+        s = re2.Set()
+        s.add('^GET')
+        s.add('500')
+        self.assertRaises(RuntimeError, s.grep_lines, data)
+        s.compile()
+        lines, offsets, indexes = s.grep_lines(data)
+        self.assertEqual(list(lines), [0, 1, 3])
+        self.assertEqual(list(offsets), [0, 1, 2, 4])
+        self.assertEqual(list(indexes)[:2], [0, 1])
+        self.assertEqual(len(s.grep_lines(data, spans=True, num_threads=2)), 5)
+
+    def test_arrow(self):
+        strings = [b'abc', b'', b'xabbc', b'ac', b'abc']
+        offsets = array.array('i', [0, 3, 3, 8, 10, 13])
+        data = b''.join(strings)
+        r = re2.compile('ab+c')
+        self.assertEqual(list(r.test_arrow(offsets, data)), [True, False, True, False, True])
+        # Arrow buffers are untyped: the offset width comes from large.
+        large = array.array('q', offsets).tobytes()
+        self.assertEqual(list(r.test_arrow(large, data, large=True)), [True, False, True, False, True])
+        self.assertEqual(list(r.test_arrow(offsets.tobytes(), data, 2, offset=2)), [True, False])
+        validity = bytes([0b11010])
+        self.assertEqual(list(r.test_arrow(offsets, data, validity=validity)),
+                         [False, False, False, False, True])
+        self.assertEqual(r.test_arrow(offsets, data, as_bitmap=True, num_threads=2), bytes([0b10101]))
+        self.assertRaises(ValueError, r.test_arrow, offsets, data, 6)
+        self.assertRaises(ValueError, r.test_arrow, offsets, data[:5])
+        self.assertRaises(ValueError, r.test_arrow, offsets, data, validity=b'')
+        self.assertRaises(TypeError, r.test_arrow, offsets, 'abc')
+
+        s = re2.Set()
+        s.add('^a')
+        s.add('x')
+        self.assertRaises(RuntimeError, s.test_arrow, offsets, data)
+        s.compile()
+        self.assertEqual(list(s.test_arrow(offsets, data, validity=validity)),
+                         [False, False, False, True, True])
+
+    def test_large_subject(self):
+        ''' subjects above the GIL release threshold match the same way '''
+        subject = 'x' * 100000 + 'abc' + 'y' * 100000
+        m = re2.compile('a(b)c').search(subject)
+        self.assertEqual(m.span(), (100000, 100003))
+        self.assertEqual(m.group(1), 'b')
+        self.assertTrue(re2.compile('y$').test_search(subject))
+
+        s = re2.Set()
+        s.add('abc')
+        s.add('zzz')
+        s.compile()
+        self.assertEqual(s.match(subject), [0])
+
+    def test_search_arguments(self):
+        ''' positional and keyword forms of pos/endpos are equivalent '''
+        r = re2.compile('b+')
+        self.assertEqual(r.search('abbbc', 2).span(), (2, 4))
+        self.assertEqual(r.search('abbbc', pos=2).span(), (2, 4))
+        self.assertEqual(r.search('abbbc', 1, 3).span(), (1, 3))
+        self.assertEqual(r.search(string='abbbc', endpos=2).span(), (1, 2))
+        self.assertTrue(r.test_search('abbbc', endpos=2))
+        self.assertRaises(TypeError, r.search)
+        self.assertRaises(TypeError, r.search, 'a', 1, 2, 3)
+        self.assertRaises(TypeError, r.search, 'a', bogus=1)
+        self.assertRaises(TypeError, r.search, 'a', 1, pos=1)
+        self.assertRaises(TypeError, r.match, 'a', 'b')
+
+    def test_accessor_arguments(self):
+        m = re2.search('(a)(b)?', 'xa')
+        self.assertEqual(m.group(), 'a')
+        self.assertEqual(m.group(0, 1, 2), ('a', 'a', None))
+        self.assertEqual(m.span(1), (1, 2))
+        self.assertEqual(m.start(2), -1)
+        self.assertRaises(TypeError, m.span, 1, 2)
+        self.assertRaises(IndexError, m.end, 3)
+
+    def test_recycled_matches(self):
+        ''' matches recycled through the freelist don't leak old groups '''
+        few = re2.compile('(a)(b)?')
+        many = re2.compile('(x)' * 20)
+        kept = []
+        for i in range(100):
+            m = few.search('ab' if i % 2 else 'a')
+            self.assertEqual(m.groups(), ('a', 'b') if i % 2 else ('a', None))
+            if i % 7 == 0:
+                kept.append(m)
+            self.assertEqual(len(many.search('x' * 20).groups()), 20)
+        self.assertEqual([m.span(2) for m in kept[:2]], [(-1, -1), (1, 2)])
+
+    def test_match_buffer(self):
+        ''' buffer-protocol subjects are matched without copying '''
+        r = re2.compile('b(c)')
+        data = bytearray(b'abcd')
+        m = r.search(data)
+        self.assertEqual(m.span(1), (2, 3))
+        self.assertEqual(m.group(1), bytearray(b'c'))
+        self.assertIs(m.string, data)
+        # The match pins the buffer until it goes away.
+        self.assertRaises(BufferError, data.extend, b'e')
+        del m
+        data.extend(b'e')
+
+        view = memoryview(b'xxabc')[1:]
+        self.assertEqual(r.search(view).span(), (2, 4))
+        self.assertEqual(bytes(r.search(view).group()), b'bc')
+        self.assertRaises(TypeError, r.search, 3)
+
+        s = re2.Set()
+        s.add('bc')
+        s.compile()
+        self.assertEqual(s.match(bytearray(b'abc')), [0])
+        self.assertEqual(s.match(memoryview(b'ab')), [])
+
+    def test_group_view(self):
+        r = re2.compile('b(c+)(x)?')
+        payload = b'ab' + b'c' * 100000
+        m = r.search(payload)
+        view = m.group_view(1)
+        self.assertIs(view.obj, payload)
+        self.assertEqual((len(view), view.readonly), (100000, True))
+        self.assertEqual(bytes(m.group_view()[:3]), b'bcc')
+        self.assertIsNone(m.group_view(2))
+        self.assertRaises(IndexError, m.group_view, 3)
+        self.assertEqual(list(m.spans()), [1, 100002, 2, 100002, -1, -1])
+        self.assertEqual(memoryview(m.spans()).format, 'q')
+
+        data = bytearray(b'abcc')
+        view = r.search(data).group_view(1)
+        self.assertRaises(BufferError, data.extend, b'e')
+        view[0:1] = b'C'
+        self.assertEqual(data, bytearray(b'abCc'))
+        view.release()
+        data.extend(b'e')
+
+        m = r.search('\xe9bc')
+        self.assertEqual(list(m.spans()), [1, 3, 2, 3, -1, -1])
+        self.assertRaises(TypeError, m.group_view)
+
+    def test_array_byte_buffer(self):
+        ''' without PyBUF_FORMAT, arrays export their items as bytes '''
+        try:
+            import _testbuffer
+        except ImportError:
+            self.skipTest('needs _testbuffer')
+        spans = re2.compile('(a)').search('xa').spans()
+        view = _testbuffer.ndarray(spans, getbuf=_testbuffer.PyBUF_STRIDES)
+        self.assertEqual((view.itemsize, view.shape, view.strides), (1, (32,), (1,)))
+        view = _testbuffer.ndarray(spans, getbuf=_testbuffer.PyBUF_FULL_RO)
+        self.assertEqual((view.itemsize, view.shape, view.format), (8, (4,), 'q'))
+
+    def test_match_huge_buffer(self):
+        ''' offsets past 4 GiB survive the trip through RE2 '''
+        size = 5 << 30
+        with tempfile.TemporaryFile() as f:
+            try:
+                f.truncate(size)
+                f.seek(size - 4)
+                f.write(b'abc\n')
+                f.flush()
+                data = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_READ)
+            except (OSError, OverflowError, ValueError):
+                self.skipTest('cannot map a sparse 5 GiB file')
+            r = re2.compile('a(b)c')
+            m = r.search(data, size - 100)
+            self.assertEqual(m.span(), (size - 4, size - 1))
+            self.assertEqual(m.span(1), (size - 3, size - 2))
+            self.assertEqual(m.group(1), b'b')
+            self.assertEqual((m.pos, m.endpos), (size - 100, size))
+            self.assertIsNone(r.search(data, size - 100, size - 2))
+            self.assertIsNone(r.search(data, 10 ** 30))
+            self.assertTrue(re2.compile('c\n').test_match(data, size - 2))
+            del m
+            data.close()
+
+    def test_match_non_ascii_str(self):
+        ''' str spans and pos/endpos count code points, not UTF-8 bytes '''
+        s = 'h\xe9llo €\U0001d11e w\xf6rld ' * 100
+        r = re2.compile('(w)(\xf6)r')
+        m = r.search(s)
+        self.assertEqual(m.span(), (9, 12))
+        self.assertEqual(m.span(2), (10, 11))
+        self.assertEqual(m.group(2), '\xf6')
+        m = r.search(s, 1000)
+        self.assertEqual(m.span(), (1014, 1017))
+        self.assertEqual(m.string[m.start():m.end()], m.group())
+        self.assertEqual((m.pos, m.endpos), (1000, len(s)))
+        self.assertIsNone(r.search(s, 1000, 1016))
+        self.assertEqual(r.search(s, 1000, 1017).end(), 1017)
+
+    def test_match_latin1_str(self):
+        ''' 1-byte str subjects are matched without a UTF-8 copy '''
+        s = 'caf\xe9 cr\xe8me br\xfbl\xe9e ' * 1000
+        size = sys.getsizeof(s)
+        m = re2.compile('(?i)(CR\xc8ME) (br.l)').search(s, 100)
+        self.assertEqual(m.span(), (113, 123))
+        self.assertEqual(m.groups(), ('cr\xe8me', 'br\xfbl'))
+        self.assertEqual(re2.compile('\\x{e9}e').search(s).span(), (15, 17))
+
+        s2 = re2.Set()
+        s2.add('br\xfbl')
+        s2.compile()
+        self.assertEqual(s2.match(s), [0])
+        self.assertEqual(sys.getsizeof(s), size)
+
+        # Patterns beyond Latin-1 fall back to matching in UTF-8.
+        self.assertIsNone(re2.compile('\u20ac').search(s))
+        self.assertEqual(re2.compile('\u20ac|(cr\xe8me)').search(s).span(1), (5, 10))
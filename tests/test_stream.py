@@ -0,0 +1,53 @@
+# Copyright (c) Facebook, Inc. and its affiliates.
+import io
+import unittest
+import re2
+
+class TestStream(unittest.TestCase):
+    def test_scan_stream(self):
+        data = b'foo 12 bar 3456 baz\n78 qux 9'
+        r = re2.compile(r'\d+')
+        expected = [(m.start(), m.end(), m.group()) for m in r.finditer(data)]
+        for size in [1, 2, 5, 100]:
+            chunks = [data[i:i + size] for i in range(0, len(data), size)]
+            self.assertEqual(list(r.scan_stream(chunks, max_match_len=8)), expected)
+            stream = io.BytesIO(data)
+            self.assertEqual(list(r.scan_stream(stream, chunk_size=size)), expected)
+        self.assertEqual(list(r.scan_stream([])), [])
+
+    def test_scan_stream_context(self):
+        r = re2.compile(r'(?m)^b\w*\b')
+        chunks = [b'ab\nb', b'cd', b'e x', b'bz\nbb']
+        self.assertEqual(list(r.scan_stream(chunks, max_match_len=3)),
+                         [(3, 7, b'bcde'), (12, 14, b'bb')])
+        self.assertEqual(list(re2.compile('x*').scan_stream([b'ab'])),
+                         [(0, 0, b''), (1, 1, b''), (2, 2, b'')])
+        # A non-empty match may start where an empty one ended.
+        r = re2.compile('|a')
+        self.assertEqual(list(r.scan_stream(io.BytesIO(b'a'))),
+                         [(0, 0, b''), (0, 1, b'a'), (1, 1, b'')])
+        self.assertEqual(list(r.scan_stream([b'b', b'a', b'a'], max_match_len=1)),
+                         [(m.start(), m.end(), m.group()) for m in r.finditer(b'baa')])
+        # Like finditer, the longest match is taken after an empty one, even
+        # for a lazy quantifier.
+        r = re2.compile('a*?')
+        expected = [(0, 0, b''), (1, 1, b''), (1, 3, b'aa'), (3, 3, b''), (4, 4, b'')]
+        self.assertEqual(list(r.scan_stream([b'baac'])), expected)
+        self.assertEqual(list(r.scan_stream([b'b', b'a', b'a', b'c'], max_match_len=1)),
+                         expected)
+
+    def test_scan_stream_errors(self):
+        r = re2.compile('a')
+        self.assertRaises(TypeError, r.scan_stream, 42)
+        self.assertRaises(TypeError, list, r.scan_stream(['a']))
+        self.assertRaises(ValueError, r.scan_stream, [], max_match_len=0)
+
+    def test_match_stream(self):
+        s = re2.Set()
+        for pattern in ['abc', 'zz', 'c d', 'q$']:
+            s.add(pattern)
+        self.assertRaises(RuntimeError, s.match_stream, [])
+        s.compile()
+        self.assertEqual(s.match_stream([b'xxab', b'c', b' dq']), [0, 2, 3])
+        self.assertEqual(s.match_stream(io.BytesIO(b'c dzz'), chunk_size=2), [1, 2])
+        self.assertEqual(s.match_stream([]), [])
@@ -0,0 +1,47 @@
+# Copyright (c) Facebook, Inc. and its affiliates.
+import unittest
+import re2
+
+class TestSub(unittest.TestCase):
+    def test_template(self):
+        r = re2.compile('(\\w)=(?P<v>\\d)?')
+        self.assertEqual(r.sub('\\2:\\1', 'a=1 b= c=3'), '1:a :b 3:c')
+        self.assertEqual(r.sub('<\\g<v>\\g<0>>', 'a=1'), '<1a=1>')
+        self.assertEqual(r.sub('\\g<1>0\\t\\101\\\\', 'a='), 'a0\tA\\')
+        self.assertEqual(r.sub(b'[\\1]', b'a=1 b=2'), b'[a] [b]')
+        self.assertEqual(r.sub(bytearray(b'-'), bytearray(b'a=1')), b'-')
+        self.assertEqual(r.subn('x', 'a=1 b=2 c=3', 2), ('x x c=3', 2))
+        self.assertEqual(r.subn('x', 'none'), ('none', 0))
+        self.assertEqual(re2.sub('a*', '-', 'baac'), '-b--c-')
+        self.assertEqual(re2.subn('\\d', '#', '1a2'), ('#a#', 2))
+        self.assertEqual(re2.subn('a', 'x', 'bab', count=-1), ('bab', 0))
+
+    def test_bad_template(self):
+        r = re2.compile('(a)')
+        for template in ('\\q', '\\2', '\\g<2>', '\\g<1', '\\'):
+            self.assertRaises(re2.error, r.sub, template, 'a')
+        self.assertRaises(IndexError, r.sub, '\\g<name>', 'a')
+        self.assertRaises(TypeError, r.sub, b'x', 'a')
+        self.assertRaisesRegexp(TypeError, '^subn\\(\\)', r.subn, 'x')
+        self.assertRaisesRegexp(TypeError, '^sub\\(\\)', r.sub, 'x', 'a', 1, 2)
+
+    def test_callable(self):
+        r = re2.compile('(\\w)(\\d)?')
+        self.assertEqual(r.sub(lambda m: m.group(1).upper(), 'a1b c'), 'AB C')
+        self.assertEqual(r.sub(lambda m: None, 'a1b c'), ' ')
+        kept = []
+        r.sub(lambda m: kept.append(m) or '', 'a1b')
+        self.assertEqual([m.span() for m in kept], [(0, 2), (2, 3)])
+        self.assertRaises(TypeError, r.sub, lambda m: 1, 'a')
+
+    def test_non_ascii(self):
+        self.assertEqual(re2.compile('(\xe9)').sub('[\\1]', 'a\xe9b'), 'a[\xe9]b')
+        self.assertEqual(re2.compile('b').sub('€', 'a\xe9b'), 'a\xe9€')
+        self.assertEqual(re2.compile('(€)').sub('\\1\\1', '\xe9€'), '\xe9€€')
+
+    def test_large_subject(self):
+        subject = 'ab' * 100000
+        self.assertEqual(re2.compile('b').sub('cc', subject), subject.replace('b', 'cc'))
+
+if __name__ == "__main__":
+    unittest.main()